@@ -0,0 +1,229 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Usage: bench-fp47map [-j] [minlog [maxlog]]
+//
+// For each backend supported by the CPU, and for 2^minlog..2^maxlog entries
+// (every other power of two, by default from 2^10, which fits in L1, to 2^24,
+// which goes to DRAM), the map is filled starting from fp47map_new(10), and
+// the following is measured (the keys are hashed on the fly, which is
+// included in the timings):
+//
+//	insert		insert throughput, including the resizes
+//	resize		the inserts which return 2 (count, mean time);
+//			max_ns is the slowest insert of all
+//	resize_incr	the same with fp47map_incremental
+//	find_hit	independent lookups of the keys in the map
+//	find_miss	independent lookups of the keys not in the map
+//	find_hit_lat	dependent lookups: the next key depends on the position
+//			found, which exposes the latency of memory access
+//	find_miss_lat	the same with the keys not in the map
+//	find_batch	fp47map_find_batch, with software-pipelined prefetch
+//
+// The output is CSV, one row per measurement, or JSON lines with -j.
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "fp47m.h"
+
+// A hashing primitive, by Pelle Evensen.
+static inline uint64_t nasam(uint64_t x)
+{
+#define ror64(x, k) (x >> k | x << (64 - k))
+    x ^= ror64(x, 25) ^ ror64(x, 47);
+    x *= 0x9e6c63d0676a9a99;
+    x ^= x >> 23 ^ x >> 51;
+    x *= 0x9e6d62d06f6a9a9b;
+    x ^= x >> 23 ^ x >> 51;
+    return x;
+}
+
+// The keys in the map are odd, 2k+1 for k < n; the even keys are missing.
+#define HIT(k) nasam(2 * (uint64_t) (k) + 1)
+#define MISS(k) nasam(2 * (uint64_t) (k) + 2)
+
+static inline uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static const char *backends[] = { "generic", "sse4", "avx2", "avx512" };
+static bool json;
+
+static void report(int simd, int logsize, const char *op, uint64_t count,
+	double ns, uint64_t maxns)
+{
+    if (json)
+	printf("{\"backend\":\"%s\",\"logsize\":%d,\"op\":\"%s\",\"count\":%" PRIu64
+		",\"ns_per_op\":%.2f,\"max_ns\":%" PRIu64 "}\n",
+		backends[simd], logsize, op, count, ns, maxns);
+    else
+	printf("%s,%d,%s,%" PRIu64 ",%.2f,%" PRIu64 "\n",
+		backends[simd], logsize, op, count, ns, maxns);
+    fflush(stdout);
+}
+
+static struct fp47map *newmap(int simd)
+{
+    struct fp47map *map = fp47map_new(10);
+    if (!map) {
+	fprintf(stderr, "bench-fp47map: fp47map_new failed\n");
+	exit(1);
+    }
+    fp47m_init(map, simd);
+    return map;
+}
+
+static void fill(struct fp47map *map, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+	if (fp47map_insert(map, HIT(k), k) < 0) {
+	    fprintf(stderr, "bench-fp47map: fp47map_insert failed\n");
+	    exit(1);
+	}
+}
+
+// Time each insert, to catch the resize pauses.
+static void pauses(int simd, int logsize, bool incr)
+{
+    struct fp47map *map = newmap(simd);
+    fp47map_incremental(map, incr);
+    size_t n = (size_t) 1 << logsize;
+    uint64_t nresize = 0, tresize = 0, maxns = 0;
+    for (size_t k = 0; k < n; k++) {
+	uint64_t t0 = now();
+	int rc = fp47map_insert(map, HIT(k), k);
+	uint64_t t = now() - t0;
+	if (rc < 0) {
+	    fprintf(stderr, "bench-fp47map: fp47map_insert failed\n");
+	    exit(1);
+	}
+	if (rc == 2)
+	    nresize++, tresize += t;
+	maxns = (t > maxns) ? t : maxns;
+    }
+    report(simd, logsize, incr ? "resize_incr" : "resize", nresize,
+	    nresize ? (double) tresize / nresize : 0, maxns);
+    fp47map_free(map);
+}
+
+// The lookups are repeated over the keys to run for at least nops.
+static void bench(int simd, int logsize)
+{
+    size_t n = (size_t) 1 << logsize;
+    size_t nops = (n > (1 << 22)) ? n : (1 << 22);
+    struct fp47map *map = newmap(simd);
+    uint64_t t = now();
+    fill(map, n);
+    t = now() - t;
+    report(simd, logsize, "insert", n, (double) t / n, 0);
+    pauses(simd, logsize, false);
+    pauses(simd, logsize, true);
+
+    // Accumulate the results, so that the lookups are not optimized out.
+    uint32_t mpos[FP47MAP_MAXFIND];
+    unsigned sum = 0;
+    t = now();
+    for (size_t j = 0; j < nops; j++)
+	sum += fp47map_find(map, HIT(j & (n - 1)), mpos);
+    t = now() - t;
+    report(simd, logsize, "find_hit", nops, (double) t / nops, 0);
+
+    t = now();
+    for (size_t j = 0; j < nops; j++)
+	sum += fp47map_find(map, MISS(j & (n - 1)), mpos);
+    t = now() - t;
+    report(simd, logsize, "find_miss", nops, (double) t / nops, 0);
+
+    // A linear congruential walk over the keys, driven by the results.
+    size_t k = 0;
+    t = now();
+    for (size_t j = 0; j < nops; j++) {
+	fp47map_find(map, HIT(k), mpos);
+	k = (mpos[0] * (size_t) 48271 + j) & (n - 1);
+    }
+    t = now() - t;
+    report(simd, logsize, "find_hit_lat", nops, (double) t / nops, 0);
+
+    t = now();
+    for (size_t j = 0; j < nops; j++) {
+	unsigned nf = fp47map_find(map, MISS(k), mpos);
+	k = ((k + nf) * (size_t) 48271 + j) & (n - 1);
+    }
+    t = now() - t;
+    report(simd, logsize, "find_miss_lat", nops, (double) t / nops, 0);
+
+    enum { B = 64 };
+    uint64_t fps[B];
+    uint32_t bpos[B][FP47MAP_MAXFIND];
+    unsigned nfound[B];
+    t = now();
+    for (size_t j = 0; j < nops; j += B) {
+	for (size_t i = 0; i < B; i++)
+	    fps[i] = HIT((j + i) & (n - 1));
+	fp47map_find_batch(map, fps, B, bpos, nfound);
+	sum += nfound[0];
+    }
+    t = now() - t;
+    report(simd, logsize, "find_batch", nops, (double) t / nops, 0);
+
+    if (sum == 0)
+	fprintf(stderr, "bench-fp47map: nothing found\n");
+    fp47map_free(map);
+}
+
+int main(int argc, char **argv)
+{
+    int minlog = 10, maxlog = 24;
+    int argi = 1;
+    if (argi < argc && strcmp(argv[argi], "-j") == 0)
+	json = true, argi++;
+    if (argi < argc)
+	minlog = maxlog = atoi(argv[argi++]);
+    if (argi < argc)
+	maxlog = atoi(argv[argi++]);
+    if (argi < argc || minlog < 4 || maxlog > 30 || minlog > maxlog) {
+	fprintf(stderr, "Usage: bench-fp47map [-j] [minlog [maxlog]]\n");
+	return 2;
+    }
+    if (!json)
+	printf("backend,logsize,op,count,ns_per_op,max_ns\n");
+    for (int simd = 0; simd <= 3; simd++) {
+#if defined(__i386__) || defined(__x86_64__)
+	if (simd == 1 && !__builtin_cpu_supports("sse4.1"))
+	    break;
+	if (simd == 2 && !__builtin_cpu_supports("avx2"))
+	    break;
+	if (simd == 3 && !(__builtin_cpu_supports("avx512f") &&
+			   __builtin_cpu_supports("avx512vl")))
+	    break;
+#else
+	if (simd > 0)
+	    break;
+#endif
+	for (int logsize = minlog; logsize <= maxlog; logsize += 2)
+	    bench(simd, logsize);
+    }
+    return 0;
+}
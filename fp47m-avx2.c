@@ -0,0 +1,69 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The AVX2 backend: the same bucket layout and the same code as SSE4,
+// except that the two 4-entry buckets are checked with a single 256-bit
+// compare, and the kick loop moves the whole bucket in a ymm register.
+// This file must be compiled with -mavx2.
+#define FP47M_AVX2
+#define fp47m_find2_sse4 fp47m_find2_avx2
+#define fp47m_find2st1_sse4 fp47m_find2st1_avx2
+#define fp47m_find2st4_sse4 fp47m_find2st4_avx2
+#define fp47m_find4_sse4 fp47m_find4_avx2
+#define fp47m_find4re_sse4 fp47m_find4re_avx2
+#define fp47m_find4mg_sse4 fp47m_find4mg_avx2
+#define fp47m_find4st1_sse4 fp47m_find4st1_avx2
+#define fp47m_find4st1re_sse4 fp47m_find4st1re_avx2
+#define fp47m_find4st1mg_sse4 fp47m_find4st1mg_avx2
+#define fp47m_find4st4_sse4 fp47m_find4st4_avx2
+#define fp47m_find4st4re_sse4 fp47m_find4st4re_avx2
+#define fp47m_find4st4mg_sse4 fp47m_find4st4mg_avx2
+#define fp47m_drain_sse4 fp47m_drain_avx2
+#define fp47m_erase2_sse4 fp47m_erase2_avx2
+#define fp47m_erase4_sse4 fp47m_erase4_avx2
+#define fp47m_erase4re_sse4 fp47m_erase4re_avx2
+#define fp47m_erase4mg_sse4 fp47m_erase4mg_avx2
+#define fp47m_find_batch2_sse4 fp47m_find_batch2_avx2
+#define fp47m_find_batch4_sse4 fp47m_find_batch4_avx2
+#define fp47m_find_batch4re_sse4 fp47m_find_batch4re_avx2
+#define fp47m_find_batch4mg_sse4 fp47m_find_batch4mg_avx2
+#define fp47m_insert2_sse4 fp47m_insert2_avx2
+#define fp47m_insert4_sse4 fp47m_insert4_avx2
+#define fp47m_insert4re_sse4 fp47m_insert4re_avx2
+#define fp47m_insert4mg_sse4 fp47m_insert4mg_avx2
+#define fp47m_insert_batch2_sse4 fp47m_insert_batch2_avx2
+#define fp47m_insert_batch4_sse4 fp47m_insert_batch4_avx2
+#define fp47m_insert_batch4re_sse4 fp47m_insert_batch4re_avx2
+#define fp47m_insert_batch4mg_sse4 fp47m_insert_batch4mg_avx2
+#define fp47m_prefetch2_sse4 fp47m_prefetch2_avx2
+#define fp47m_prefetch4_sse4 fp47m_prefetch4_avx2
+#define fp47m_prefetch4re_sse4 fp47m_prefetch4re_avx2
+#define fp47m_prefetch4mg_sse4 fp47m_prefetch4mg_avx2
+#define fp47m_replace2_sse4 fp47m_replace2_avx2
+#define fp47m_replace4_sse4 fp47m_replace4_avx2
+#define fp47m_replace4re_sse4 fp47m_replace4re_avx2
+#define fp47m_replace4mg_sse4 fp47m_replace4mg_avx2
+#define fp47m_shrink_sse4 fp47m_shrink_avx2
+#define fp47m_reserve_sse4 fp47m_reserve_avx2
+#define fp47m_migrate_sse4 fp47m_migrate_avx2
+#define fp47m_setvf_sse4 fp47m_setvf_avx2
+#define fp47m_resize2_sse4 fp47m_resize2_avx2
+#define fp47m_resize4_sse4 fp47m_resize4_avx2
+#include "fp47m-sse4.c"
@@ -0,0 +1,502 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The concurrent mode: many writers, many lock-free readers.
+//
+// The readers use a snapshot of the map structure (the stash, the vfuncs
+// and the masks), which shares the buckets with the writers' map, and which
+// is republished whenever the structure changes.  The buckets are covered by
+// a seqlock per stripe of buckets, and the readers retry if any of their two
+// buckets has been modified.  The writers lock the stripes by making their
+// counters odd, which the readers observe as a write in progress.
+// An entry which needs to be kicked out is not picked up and carried along
+// like in the kick loop: the path to a free slot is found first, then its
+// stripes are locked (in order, to avoid deadlocks), and the entries are
+// moved one by one, starting from the end of the path, so that each entry
+// is always in one of its buckets.  Only when there is no such path (which
+// means that the entry goes to the stash), or when the map needs to grow,
+// the other writers are stopped, and the regular insert is run under a
+// global seqlock.  The buckets which are replaced on resize are released
+// once the readers are done with them (epoch-based reclamation).  Since
+// the old buckets are not modified on resize, the readers keep using them
+// until the new snapshot is published.
+#include <sched.h>
+#include <sys/mman.h>
+#include "fp47m.h"
+
+#define NSTRIPE 1024
+#define NSLOT 64
+
+// Each thread gets a slot: the readers count themselves by epoch parity,
+// and the writers count themselves so that they can be stopped.
+struct slot {
+    unsigned cnt[2];
+    unsigned w;
+} __attribute__((aligned(64)));
+
+// The seqlock, odd while the stripe is locked by a writer.
+struct stripe {
+    unsigned seq;
+} __attribute__((aligned(64)));
+
+struct retired {
+    void *p;
+    size_t size;
+};
+
+struct fp47map_mt {
+    // Two buffers for the snapshots, used in turn.
+    struct fp47map snap[2];
+    // The snapshot currently in use by the readers.
+    struct fp47map *cur;
+    // The writers' map.
+    struct fp47map *map;
+    // The buckets are allocated here, to keep the old ones around.
+    struct fp47map_alloc alloc;
+    struct retired ret[8];
+    unsigned nret;
+    unsigned gseq;
+    unsigned epoch;
+    // Set while one writer has the map to itself.
+    unsigned stw;
+    struct slot slot[NSLOT];
+    struct stripe stripe[NSTRIPE];
+};
+
+#define load(p, mo) __atomic_load_n(p, __ATOMIC_##mo)
+#define store(p, v, mo) __atomic_store_n(p, v, __ATOMIC_##mo)
+#define fence(mo) __atomic_thread_fence(__ATOMIC_##mo)
+
+// Spin for a while, then yield (the other thread may have been preempted).
+static inline void relax(unsigned *spins)
+{
+    if (++*spins % 64 == 0) {
+	sched_yield();
+	return;
+    }
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void *mtalloc(void *ctx, size_t size, size_t align)
+{
+    (void) ctx;
+    if (size < MTHRESH)
+	return aligned_alloc(align, size);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+// Called on resize, while the old buckets are still in use by the readers.
+static void mtfree(void *ctx, void *p, size_t size)
+{
+    struct fp47map_mt *mt = ctx;
+    assert(mt->nret < 8);
+    mt->ret[mt->nret++] = (struct retired) { p, size };
+}
+
+static void reclaim(struct fp47map_mt *mt)
+{
+    for (unsigned j = 0; j < mt->nret; j++) {
+	if (mt->ret[j].size < MTHRESH)
+	    free(mt->ret[j].p);
+	else {
+	    int rc = munmap(mt->ret[j].p, mt->ret[j].size);
+	    assert(rc == 0);
+	}
+    }
+    mt->nret = 0;
+}
+
+static struct slot *myslot(struct fp47map_mt *mt)
+{
+    static unsigned nthreads;
+    static __thread unsigned tid = -1;
+    if (unlikely(tid == -1U))
+	tid = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+    return &mt->slot[tid % NSLOT];
+}
+
+static inline unsigned enter(struct fp47map_mt *mt, struct slot *sl)
+{
+    while (1) {
+	unsigned e = load(&mt->epoch, RELAXED);
+	__atomic_fetch_add(&sl->cnt[e & 1], 1, __ATOMIC_SEQ_CST);
+	if (likely(load(&mt->epoch, SEQ_CST) == e))
+	    return e;
+	__atomic_fetch_sub(&sl->cnt[e & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void leave(struct slot *sl, unsigned e)
+{
+    __atomic_fetch_sub(&sl->cnt[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+// Wait until the readers which might have seen the previous snapshot
+// are gone, then free the old buckets.
+static void quiesce(struct fp47map_mt *mt)
+{
+    unsigned e = mt->epoch, spins = 0;
+    store(&mt->epoch, e + 1, SEQ_CST);
+    for (unsigned j = 0; j < NSLOT; j++)
+	while (load(&mt->slot[j].cnt[e & 1], ACQUIRE))
+	    relax(&spins);
+    reclaim(mt);
+}
+
+// Must be followed by quiesce() before the next publish().
+static void publish(struct fp47map_mt *mt)
+{
+    struct fp47map *s = &mt->snap[mt->cur == &mt->snap[0]];
+    memcpy(s, mt->map, sizeof *s);
+    store(&mt->cur, s, RELEASE);
+}
+
+static inline void wenter(struct fp47map_mt *mt, struct slot *sl)
+{
+    unsigned spins = 0;
+    while (1) {
+	__atomic_fetch_add(&sl->w, 1, __ATOMIC_SEQ_CST);
+	if (likely(!load(&mt->stw, SEQ_CST)))
+	    return;
+	__atomic_fetch_sub(&sl->w, 1, __ATOMIC_RELEASE);
+	while (load(&mt->stw, RELAXED))
+	    relax(&spins);
+    }
+}
+
+static inline void wleave(struct slot *sl)
+{
+    __atomic_fetch_sub(&sl->w, 1, __ATOMIC_RELEASE);
+}
+
+// Stop the other writers (the caller must not be counted as a writer).
+static void stop(struct fp47map_mt *mt)
+{
+    unsigned zero = 0, spins = 0;
+    while (!__atomic_compare_exchange_n(&mt->stw, &zero, 1, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	zero = 0, relax(&spins);
+    for (unsigned j = 0; j < NSLOT; j++)
+	while (load(&mt->slot[j].w, SEQ_CST))
+	    relax(&spins);
+}
+
+static inline void start(struct fp47map_mt *mt)
+{
+    store(&mt->stw, 0, RELEASE);
+}
+
+static inline void lock(unsigned *q)
+{
+    unsigned spins = 0;
+    while (1) {
+	unsigned v = load(q, RELAXED);
+	if (likely(!(v & 1)) && __atomic_compare_exchange_n(q, &v, v + 1, false,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+	relax(&spins);
+    }
+    fence(RELEASE);
+}
+
+static inline void unlock(unsigned *q)
+{
+    store(q, *q + 1, RELEASE);
+}
+
+// Lock a set of stripes in ascending order, dropping the duplicates.
+// Returns the number of stripes actually locked.
+static unsigned lockset(struct fp47map_mt *mt, unsigned *q, unsigned n)
+{
+    unsigned m = 0;
+    for (unsigned k = 0; k < n; k++) {
+	unsigned x = q[k], i = m;
+	while (i > 0 && q[i-1] > x)
+	    i--;
+	if (i > 0 && q[i-1] == x)
+	    continue;
+	memmove(q + i + 1, q + i, (m - i) * sizeof *q);
+	q[i] = x, m++;
+    }
+    for (unsigned k = 0; k < m; k++)
+	lock(&mt->stripe[q[k]].seq);
+    return m;
+}
+
+static void unlockset(struct fp47map_mt *mt, const unsigned *q, unsigned m)
+{
+    for (unsigned k = m; k > 0; k--)
+	unlock(&mt->stripe[q[k-1]].seq);
+}
+
+// The bucket indexes and the tag, in any state.
+static inline void mtindex(const struct fp47map *map, uint64_t fp,
+	uint32_t *pi1, uint32_t *pi2, uint32_t *ptag)
+{
+    dFP2I;
+    if (map->logsize1 > map->logsize0)
+	ResizeI;
+    *pi1 = i1, *pi2 = i2, *ptag = tag;
+}
+
+// The tags can also be read without locking, to find a path.
+static inline uint32_t gettag(const struct fp47map *map, uint32_t i, unsigned j)
+{
+    return load(tagp(map, i, j), RELAXED);
+}
+
+static inline int freeslot(const struct fp47map *map, uint32_t i)
+{
+    for (unsigned j = 0; j < map->bsize; j++)
+	if (gettag(map, i, j) == 0)
+	    return j;
+    return -1;
+}
+
+// With the stripes locked.  The position goes first, so that the readers
+// never see a tag with a stale position.
+static inline void put(const struct fp47map *map, uint32_t i, unsigned j, uint32_t tag, uint32_t pos)
+{
+    store(posp(map, i, j), pos, RELAXED);
+    store(tagp(map, i, j), tag, RELAXED);
+}
+
+static inline void move(const struct fp47map *map, uint32_t i, unsigned j, uint32_t di, unsigned dj)
+{
+    put(map, di, dj, *tagp(map, i, j), *posp(map, i, j));
+    store(tagp(map, i, j), 0, RELAXED);
+}
+
+// Put the entry into a free slot, if there is one.
+static bool tryput(struct fp47map_mt *mt, uint32_t i1, uint32_t i2, uint32_t tag, uint32_t pos)
+{
+    const struct fp47map *map = mt->map;
+    unsigned q[2] = { i1 % NSTRIPE, i2 % NSTRIPE };
+    unsigned m = lockset(mt, q, 2);
+    int j1 = freeslot(map, i1);
+    int j2 = freeslot(map, i2);
+    bool ok = j1 >= 0 || j2 >= 0;
+    if (j1 >= 0 && (j2 < 0 || j1 <= j2))
+	put(map, i1, j1, tag, pos);
+    else if (j2 >= 0)
+	put(map, i2, j2, tag, pos);
+    unlockset(mt, q, m);
+    return ok;
+}
+
+struct step {
+    uint32_t i;
+    unsigned j;
+};
+
+// Find a path from bucket i to a free slot, without moving anything.
+// Returns the number of kicks, 0 if there's no path.
+static unsigned findpath(const struct fp47map *map, uint32_t i, uint32_t seed,
+	struct step *path)
+{
+    for (unsigned k = 0; k <= map->maxkick; k++) {
+	// Pick the entry to kick out pseudo-randomly, to avoid short cycles.
+	seed = seed * 1103515245 + 12345;
+	unsigned j = (seed >> 16) % map->bsize;
+	for (unsigned m = 0; m < k; m++)
+	    if (path[m].i == i && path[m].j == j)
+		return 0;
+	path[k] = (struct step) { i, j };
+	i = (i ^ XD(gettag(map, i, j))) & map->mask1;
+	int e = freeslot(map, i);
+	if (e >= 0) {
+	    path[k+1] = (struct step) { i, e };
+	    return k + 1;
+	}
+    }
+    return 0;
+}
+
+// Check the path again, once its stripes are locked.
+static bool validpath(const struct fp47map *map, const struct step *path, unsigned n)
+{
+    for (unsigned k = 0; k < n; k++) {
+	uint32_t t = *tagp(map, path[k].i, path[k].j);
+	if (t == 0 || ((path[k].i ^ XD(t)) & map->mask1) != path[k+1].i)
+	    return false;
+    }
+    return *tagp(map, path[n].i, path[n].j) == 0;
+}
+
+static bool kick(struct fp47map_mt *mt, uint32_t i1, uint32_t i2, uint32_t tag, uint32_t pos)
+{
+    const struct fp47map *map = mt->map;
+    struct step path[256+1];
+    unsigned q[256+1];
+    // The path can be spoiled by the other writers, try a few times.
+    for (int try = 0; try < 4; try++) {
+	unsigned n = findpath(map, i1, tag, path);
+	if (n == 0)
+	    n = findpath(map, i2, ~tag, path);
+	if (n == 0)
+	    return false;
+	for (unsigned k = 0; k <= n; k++)
+	    q[k] = path[k].i % NSTRIPE;
+	unsigned m = lockset(mt, q, n + 1);
+	bool ok = validpath(map, path, n);
+	if (ok) {
+	    for (unsigned k = n; k > 0; k--)
+		move(map, path[k-1].i, path[k-1].j, path[k].i, path[k].j);
+	    put(map, path[0].i, path[0].j, tag, pos);
+	}
+	unlockset(mt, q, m);
+	if (ok)
+	    return true;
+    }
+    return false;
+}
+
+// Whether the next insert should resize the map.
+static inline bool mtfull(const struct fp47map *map)
+{
+    if (map->bsize == 2)
+	return full2(load(&map->cnt, RELAXED) + 1, map->mask0, map->load2);
+    return full4(load(&map->cnt, RELAXED) + 1, map->mask1, map->load4);
+}
+
+// Grow the map by one step, via fp47map_reserve, which does not modify
+// the old buckets, so the readers can go on in the meantime.
+static int grow(struct fp47map_mt *mt)
+{
+    struct fp47map *map = mt->map;
+    size_t n = (map->bsize == 2) ?
+	fillmax(2, map->mask0, map->load2) + 1 :
+	fillmax(4, map->mask1, map->load4) + 1;
+    int rc = fp47map_reserve(map, n);
+    if (rc > 0) {
+	publish(mt);
+	quiesce(mt);
+    }
+    return rc;
+}
+
+// With the other writers stopped.
+static int insertx(struct fp47map_mt *mt, uint64_t fp, uint32_t pos)
+{
+    struct fp47map *map = mt->map;
+    int ret = 1;
+    while (1) {
+	uint32_t i1, i2, tag;
+	mtindex(map, fp, &i1, &i2, &tag);
+	if (tryput(mt, i1, i2, tag, pos)) {
+	    map->cnt++;
+	    return ret;
+	}
+	bool full = mtfull(map);
+	if (!full && kick(mt, i1, i2, tag, pos)) {
+	    map->cnt++;
+	    return ret;
+	}
+	if (!full && map->nstash < 4)
+	    break;
+	int rc = grow(mt);
+	if (rc < 0)
+	    return rc;
+	if (rc == 0)
+	    break;
+	ret = 2;
+    }
+    // The entry goes to the stash, possibly after the regular kick loop.
+    store(&mt->gseq, mt->gseq + 1, RELAXED);
+    fence(RELEASE);
+    int rc = map->insert(fp, map, pos);
+    publish(mt);
+    store(&mt->gseq, mt->gseq + 1, RELEASE);
+    quiesce(mt);
+    return (rc == 1) ? ret : rc;
+}
+
+struct fp47map_mt *fp47map_mt_new(int logsize)
+{
+    struct fp47map_mt *mt = aligned_alloc(64, sizeof *mt);
+    if (!mt)
+	return NULL;
+    memset(mt, 0, sizeof *mt);
+    mt->alloc = (struct fp47map_alloc) { mtalloc, NULL, mtfree, mt };
+    mt->map = fp47map_new_alloc(logsize, &mt->alloc);
+    if (!mt->map)
+	return free(mt), NULL;
+    publish(mt);
+    return mt;
+}
+
+void fp47map_mt_free(struct fp47map_mt *mt)
+{
+    if (!mt)
+	return;
+    fp47map_free(mt->map);
+    reclaim(mt);
+    free(mt);
+}
+
+int fp47map_mt_insert(struct fp47map_mt *mt, uint64_t fp, uint32_t pos)
+{
+    struct fp47map *map = mt->map;
+    struct slot *sl = myslot(mt);
+    wenter(mt, sl);
+    uint32_t i1, i2, tag;
+    mtindex(map, fp, &i1, &i2, &tag);
+    bool done = tryput(mt, i1, i2, tag, pos) ||
+		(!mtfull(map) && kick(mt, i1, i2, tag, pos));
+    if (done)
+	__atomic_fetch_add(&map->cnt, 1, __ATOMIC_RELAXED);
+    wleave(sl);
+    if (likely(done))
+	return 1;
+    stop(mt);
+    int rc = insertx(mt, fp, pos);
+    start(mt);
+    return rc;
+}
+
+unsigned fp47map_mt_find(struct fp47map_mt *mt, uint64_t fp, uint32_t *mpos)
+{
+    struct slot *sl = myslot(mt);
+    unsigned e = enter(mt, sl);
+    unsigned n, spins = 0;
+    while (1) {
+	unsigned g = load(&mt->gseq, ACQUIRE);
+	const struct fp47map *map = load(&mt->cur, ACQUIRE);
+	uint32_t i1, i2, tag;
+	mtindex(map, fp, &i1, &i2, &tag);
+	unsigned *q1 = &mt->stripe[i1 % NSTRIPE].seq;
+	unsigned *q2 = &mt->stripe[i2 % NSTRIPE].seq;
+	unsigned v1 = load(q1, ACQUIRE);
+	unsigned v2 = load(q2, ACQUIRE);
+	if (likely(((g | v1 | v2) & 1) == 0)) {
+	    n = map->find(fp, map, mpos);
+	    fence(ACQUIRE);
+	    if (likely(load(q1, RELAXED) == v1 && load(q2, RELAXED) == v2 &&
+		       load(&mt->gseq, RELAXED) == g))
+		break;
+	}
+	relax(&spins);
+    }
+    leave(sl, e);
+    return n;
+}
@@ -0,0 +1,210 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The sharded map: 2^k independent maps, each behind its own lock.
+// The shard is selected by the top k bits of the fingerprint.  These bits
+// also feed into the bucket index, but only when the shard's initial logsize
+// exceeds 32-k, which is ruled out; the rest of the index comes from the tag
+// on resize.  Each shard resizes on its own, so a big map does not stall
+// the caller for the whole reinterp: the pauses are smaller and spread out.
+#include <pthread.h>
+#include "fp47m.h"
+
+// Keeps the locks of the neighbouring shards apart.
+struct shard {
+    pthread_rwlock_t lock;
+    struct fp47map *map;
+} __attribute__((aligned(64)));
+
+struct fp47map_sharded {
+    unsigned logshards;
+    struct shard shard[];
+};
+
+static inline struct shard *shardof(struct fp47map_sharded *s, uint64_t fp)
+{
+    return &s->shard[fp >> 32 >> (32 - s->logshards)];
+}
+
+struct fp47map_sharded *fp47map_sharded_new(int logshards, int logsize)
+{
+    assert(logshards >= 0 && logshards <= FP47MAP_MAXLOGSHARDS);
+    logsize -= logshards;
+    if (logsize > 32 - logshards)
+	logsize = 32 - logshards;
+    size_t n = (size_t) 1 << logshards;
+    struct fp47map_sharded *s = aligned_alloc(64, sizeof *s + n * sizeof s->shard[0]);
+    if (!s)
+	return NULL;
+    s->logshards = logshards;
+    for (size_t j = 0; j < n; j++) {
+	s->shard[j].map = fp47map_new(logsize < 0 ? 0 : logsize);
+	if (!s->shard[j].map) {
+	    while (j-- > 0) {
+		pthread_rwlock_destroy(&s->shard[j].lock);
+		fp47map_free(s->shard[j].map);
+	    }
+	    return free(s), NULL;
+	}
+	pthread_rwlock_init(&s->shard[j].lock, NULL);
+    }
+    return s;
+}
+
+void fp47map_sharded_free(struct fp47map_sharded *s)
+{
+    if (!s)
+	return;
+    for (size_t j = 0; j < (size_t) 1 << s->logshards; j++) {
+	pthread_rwlock_destroy(&s->shard[j].lock);
+	fp47map_free(s->shard[j].map);
+    }
+    free(s);
+}
+
+unsigned fp47map_sharded_find(struct fp47map_sharded *s, uint64_t fp, uint32_t *mpos)
+{
+    struct shard *sh = shardof(s, fp);
+    pthread_rwlock_rdlock(&sh->lock);
+    unsigned n = fp47map_find(sh->map, fp, mpos);
+    pthread_rwlock_unlock(&sh->lock);
+    return n;
+}
+
+int fp47map_sharded_insert(struct fp47map_sharded *s, uint64_t fp, uint32_t pos)
+{
+    struct shard *sh = shardof(s, fp);
+    pthread_rwlock_wrlock(&sh->lock);
+    int rc = fp47map_insert(sh->map, fp, pos);
+    pthread_rwlock_unlock(&sh->lock);
+    return rc;
+}
+
+int fp47map_sharded_delete(struct fp47map_sharded *s, uint64_t fp, uint32_t pos)
+{
+    struct shard *sh = shardof(s, fp);
+    pthread_rwlock_wrlock(&sh->lock);
+    int rc = fp47map_delete(sh->map, fp, pos);
+    pthread_rwlock_unlock(&sh->lock);
+    return rc;
+}
+
+// The counters of the shards, added up.
+int fp47map_sharded_stats(struct fp47map_sharded *s, struct fp47map_stats *st)
+{
+    memset(st, 0, sizeof *st);
+    uint64_t *dst = (void *) st;
+    for (size_t j = 0; j < (size_t) 1 << s->logshards; j++) {
+	struct shard *sh = &s->shard[j];
+	struct fp47map_stats st1;
+	pthread_rwlock_rdlock(&sh->lock);
+	int rc = fp47map_stats(sh->map, &st1);
+	pthread_rwlock_unlock(&sh->lock);
+	if (rc < 0)
+	    return rc;
+	const uint64_t *src = (const void *) &st1;
+	for (size_t k = 0; k < sizeof *st / 8; k++)
+	    dst[k] += src[k];
+    }
+    return 0;
+}
+
+// The batches are routed in chunks: the keys are sorted by shard
+// (a counting sort), and each shard's run is passed on to its batch
+// vfunc under a single lock.
+#define CHUNK 256
+
+// Returns the number of distinct shards; run[k] is the shard number,
+// and the keys of the run are ix[off[k]..off[k+1]).
+static unsigned route(struct fp47map_sharded *s, const uint64_t *fps, size_t n,
+	uint16_t *ix, uint16_t *run, uint16_t *off)
+{
+    uint16_t cnt[1 << FP47MAP_MAXLOGSHARDS];
+    size_t nshards = (size_t) 1 << s->logshards;
+    memset(cnt, 0, nshards * sizeof cnt[0]);
+    for (size_t i = 0; i < n; i++)
+	cnt[shardof(s, fps[i]) - s->shard]++;
+    unsigned nrun = 0, o = 0;
+    for (size_t j = 0; j < nshards; j++) {
+	if (cnt[j] == 0)
+	    continue;
+	run[nrun] = j, off[nrun++] = o;
+	unsigned c = cnt[j];
+	cnt[j] = o, o += c;
+    }
+    off[nrun] = o;
+    for (size_t i = 0; i < n; i++)
+	ix[cnt[shardof(s, fps[i]) - s->shard]++] = i;
+    return nrun;
+}
+
+int fp47map_sharded_insert_batch(struct fp47map_sharded *s,
+	const uint64_t *fps, const uint32_t *pos, size_t n)
+{
+    int ret = 1;
+    uint16_t ix[CHUNK], run[CHUNK], off[CHUNK+1];
+    uint64_t xfps[CHUNK];
+    uint32_t xpos[CHUNK];
+    for (size_t i0 = 0; i0 < n; i0 += CHUNK) {
+	size_t m = n - i0 < CHUNK ? n - i0 : CHUNK;
+	unsigned nrun = route(s, fps + i0, m, ix, run, off);
+	for (size_t i = 0; i < m; i++)
+	    xfps[i] = fps[i0+ix[i]], xpos[i] = pos[i0+ix[i]];
+	for (unsigned k = 0; k < nrun; k++) {
+	    struct shard *sh = &s->shard[run[k]];
+	    pthread_rwlock_wrlock(&sh->lock);
+	    int rc = fp47map_insert_batch(sh->map, xfps + off[k], xpos + off[k],
+		    off[k+1] - off[k]);
+	    pthread_rwlock_unlock(&sh->lock);
+	    if (rc < 0)
+		return rc;
+	    if (rc > ret)
+		ret = rc;
+	}
+    }
+    return ret;
+}
+
+void fp47map_sharded_find_batch(struct fp47map_sharded *s,
+	const uint64_t *fps, size_t n,
+	uint32_t mpos[][FP47MAP_MAXFIND], unsigned nfound[])
+{
+    uint16_t ix[CHUNK], run[CHUNK], off[CHUNK+1];
+    uint64_t xfps[CHUNK];
+    uint32_t xmpos[CHUNK][FP47MAP_MAXFIND];
+    unsigned xnfound[CHUNK];
+    for (size_t i0 = 0; i0 < n; i0 += CHUNK) {
+	size_t m = n - i0 < CHUNK ? n - i0 : CHUNK;
+	unsigned nrun = route(s, fps + i0, m, ix, run, off);
+	for (size_t i = 0; i < m; i++)
+	    xfps[i] = fps[i0+ix[i]];
+	for (unsigned k = 0; k < nrun; k++) {
+	    struct shard *sh = &s->shard[run[k]];
+	    pthread_rwlock_rdlock(&sh->lock);
+	    fp47map_find_batch(sh->map, xfps + off[k], off[k+1] - off[k],
+		    xmpos + off[k], xnfound + off[k]);
+	    pthread_rwlock_unlock(&sh->lock);
+	}
+	for (size_t i = 0; i < m; i++) {
+	    unsigned c = nfound[i0+ix[i]] = xnfound[i];
+	    memcpy(mpos[i0+ix[i]], xmpos[i], c * sizeof xmpos[i][0]);
+	}
+    }
+}
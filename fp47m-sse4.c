@@ -20,6 +20,18 @@
 
 #include "fp47m.h"
 #include <smmintrin.h>
+#ifdef FP47M_AVX2
+#include <immintrin.h>
+#endif
+
+// XD (see fp47m.h) for the vectors of tags.
+#ifdef FP47M_WINDOW
+#define XXD(x) _mm_or_si128(_mm_srli_epi32(x, 32 - FP47M_WINDOW), _mm_set1_epi32(1))
+#define YXD(y) _mm256_or_si256(_mm256_srli_epi32(y, 32 - FP47M_WINDOW), _mm256_set1_epi32(1))
+#else
+#define XXD(x) (x)
+#define YXD(y) (y)
+#endif
 
 static const struct {
     union {
@@ -78,6 +90,55 @@ static const struct {
 
 #define ctz32(x) (unsigned)__builtin_ctz(x)
 
+#if defined(FP47M_AVX2) && !defined(FP47M_AVX512)
+// With AVX2, the 8 slots of the two buckets are compacted with vpermd.
+// For each mask, the indexes of the matching slots are packed into nibbles;
+// vpermd only looks at the low 3 bits of each dword, so the packed value
+// can be simply broadcast and shifted by 0, 4, 8, ... bits.
+static const uint32_t perm8[256] = {
+/* 00 */ 0x00000000, 0x00000000, 0x00000001, 0x00000010, 0x00000002, 0x00000020, 0x00000021, 0x00000210,
+/* 08 */ 0x00000003, 0x00000030, 0x00000031, 0x00000310, 0x00000032, 0x00000320, 0x00000321, 0x00003210,
+/* 10 */ 0x00000004, 0x00000040, 0x00000041, 0x00000410, 0x00000042, 0x00000420, 0x00000421, 0x00004210,
+/* 18 */ 0x00000043, 0x00000430, 0x00000431, 0x00004310, 0x00000432, 0x00004320, 0x00004321, 0x00043210,
+/* 20 */ 0x00000005, 0x00000050, 0x00000051, 0x00000510, 0x00000052, 0x00000520, 0x00000521, 0x00005210,
+/* 28 */ 0x00000053, 0x00000530, 0x00000531, 0x00005310, 0x00000532, 0x00005320, 0x00005321, 0x00053210,
+/* 30 */ 0x00000054, 0x00000540, 0x00000541, 0x00005410, 0x00000542, 0x00005420, 0x00005421, 0x00054210,
+/* 38 */ 0x00000543, 0x00005430, 0x00005431, 0x00054310, 0x00005432, 0x00054320, 0x00054321, 0x00543210,
+/* 40 */ 0x00000006, 0x00000060, 0x00000061, 0x00000610, 0x00000062, 0x00000620, 0x00000621, 0x00006210,
+/* 48 */ 0x00000063, 0x00000630, 0x00000631, 0x00006310, 0x00000632, 0x00006320, 0x00006321, 0x00063210,
+/* 50 */ 0x00000064, 0x00000640, 0x00000641, 0x00006410, 0x00000642, 0x00006420, 0x00006421, 0x00064210,
+/* 58 */ 0x00000643, 0x00006430, 0x00006431, 0x00064310, 0x00006432, 0x00064320, 0x00064321, 0x00643210,
+/* 60 */ 0x00000065, 0x00000650, 0x00000651, 0x00006510, 0x00000652, 0x00006520, 0x00006521, 0x00065210,
+/* 68 */ 0x00000653, 0x00006530, 0x00006531, 0x00065310, 0x00006532, 0x00065320, 0x00065321, 0x00653210,
+/* 70 */ 0x00000654, 0x00006540, 0x00006541, 0x00065410, 0x00006542, 0x00065420, 0x00065421, 0x00654210,
+/* 78 */ 0x00006543, 0x00065430, 0x00065431, 0x00654310, 0x00065432, 0x00654320, 0x00654321, 0x06543210,
+/* 80 */ 0x00000007, 0x00000070, 0x00000071, 0x00000710, 0x00000072, 0x00000720, 0x00000721, 0x00007210,
+/* 88 */ 0x00000073, 0x00000730, 0x00000731, 0x00007310, 0x00000732, 0x00007320, 0x00007321, 0x00073210,
+/* 90 */ 0x00000074, 0x00000740, 0x00000741, 0x00007410, 0x00000742, 0x00007420, 0x00007421, 0x00074210,
+/* 98 */ 0x00000743, 0x00007430, 0x00007431, 0x00074310, 0x00007432, 0x00074320, 0x00074321, 0x00743210,
+/* a0 */ 0x00000075, 0x00000750, 0x00000751, 0x00007510, 0x00000752, 0x00007520, 0x00007521, 0x00075210,
+/* a8 */ 0x00000753, 0x00007530, 0x00007531, 0x00075310, 0x00007532, 0x00075320, 0x00075321, 0x00753210,
+/* b0 */ 0x00000754, 0x00007540, 0x00007541, 0x00075410, 0x00007542, 0x00075420, 0x00075421, 0x00754210,
+/* b8 */ 0x00007543, 0x00075430, 0x00075431, 0x00754310, 0x00075432, 0x00754320, 0x00754321, 0x07543210,
+/* c0 */ 0x00000076, 0x00000760, 0x00000761, 0x00007610, 0x00000762, 0x00007620, 0x00007621, 0x00076210,
+/* c8 */ 0x00000763, 0x00007630, 0x00007631, 0x00076310, 0x00007632, 0x00076320, 0x00076321, 0x00763210,
+/* d0 */ 0x00000764, 0x00007640, 0x00007641, 0x00076410, 0x00007642, 0x00076420, 0x00076421, 0x00764210,
+/* d8 */ 0x00007643, 0x00076430, 0x00076431, 0x00764310, 0x00076432, 0x00764320, 0x00764321, 0x07643210,
+/* e0 */ 0x00000765, 0x00007650, 0x00007651, 0x00076510, 0x00007652, 0x00076520, 0x00076521, 0x00765210,
+/* e8 */ 0x00007653, 0x00076530, 0x00076531, 0x00765310, 0x00076532, 0x00765320, 0x00765321, 0x07653210,
+/* f0 */ 0x00007654, 0x00076540, 0x00076541, 0x00765410, 0x00076542, 0x00765420, 0x00765421, 0x07654210,
+/* f8 */ 0x00076543, 0x00765430, 0x00765431, 0x07654310, 0x00765432, 0x07654320, 0x07654321, 0x76543210,
+};
+#endif
+
+#ifdef FP47M_AVX2
+#ifndef __POPCNT__
+#define popcnt8(x) (lut.popcnt[(x)&15] + lut.popcnt[(x)>>4])
+#else
+#define popcnt8(x) (unsigned)__builtin_popcount(x)
+#endif
+#endif
+
 union buck2 {
     __m128 ps;
     __m128i x;
@@ -134,6 +195,14 @@ static void FASTCALL fp47m_prefetch4re_sse4(uint64_t fp, const struct fp47map *m
     __builtin_prefetch(&bb[i2]);
 }
 
+static void FASTCALL fp47m_prefetch4mg_sse4(uint64_t fp, const struct fp47map *map)
+{
+    dFP2I; ResizeI; MigI;
+    struct buck4 *bb = map->bb;
+    __builtin_prefetch(&bb[i1]);
+    __builtin_prefetch(&bb[i2]);
+}
+
 static inline unsigned find2(__m128 xb1, __m128 xb2, uint32_t tag, void *mpos)
 {
     __m128i xtag = _mm_castps_si128(_mm_shuffle_ps(xb1, xb2, _MM_SHUFFLE(2, 0, 2, 0)));
@@ -152,24 +221,50 @@ static inline unsigned find4(__m128i xtag, __m128i xpos, uint32_t tag, void *mpo
     return popcnt4(mask);
 }
 
-static inline unsigned findst1(const void *st_, uint32_t i1, uint32_t tag, uint32_t *mpos)
+// Check both buckets, the matches in b1 go first.
+static inline unsigned find4x2(const struct buck4 *b1, const struct buck4 *b2, uint32_t tag, uint32_t *mpos)
+{
+#if defined(FP47M_AVX512)
+    __m256i ytag = _mm256_inserti128_si256(_mm256_castsi128_si256(b1->xtag), b2->xtag, 1);
+    __m256i ypos = _mm256_inserti128_si256(_mm256_castsi128_si256(b1->xpos), b2->xpos, 1);
+    __mmask8 mask = _mm256_cmpeq_epi32_mask(ytag, _mm256_set1_epi32(tag));
+    _mm256_storeu_si256((void *) mpos, _mm256_maskz_compress_epi32(mask, ypos));
+    return popcnt8(mask);
+#elif defined(FP47M_AVX2)
+    __m256i ytag = _mm256_inserti128_si256(_mm256_castsi128_si256(b1->xtag), b2->xtag, 1);
+    __m256i ypos = _mm256_inserti128_si256(_mm256_castsi128_si256(b1->xpos), b2->xpos, 1);
+    __m256i ycmp = _mm256_cmpeq_epi32(ytag, _mm256_set1_epi32(tag));
+    unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(ycmp));
+    __m256i yperm = _mm256_srlv_epi32(_mm256_set1_epi32(perm8[mask]),
+	    _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28));
+    _mm256_storeu_si256((void *) mpos, _mm256_permutevar8x32_epi32(ypos, yperm));
+    return popcnt8(mask);
+#else
+    unsigned n = find4(b1->xtag, b1->xpos, tag, mpos);
+    return   n + find4(b2->xtag, b2->xpos, tag, mpos + n);
+#endif
+}
+
+static inline unsigned findst1(const struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t *mpos)
 {
-    const struct stash *st = st_;
+    const struct stash *st = (const void *) map->stash;
     if (likely(st->tag[0] != tag))
 	return 0;
     if (unlikely(st->i1[0] != i1))
 	return 0;
     *mpos = st->pos[0];
+    STAT(map, sthits, 1);
     return 1;
 }
 
-static inline unsigned findst4(const void *st_, uint32_t i1, uint32_t tag, void *mpos)
+static inline unsigned findst4(const struct fp47map *map, uint32_t i1, uint32_t tag, void *mpos)
 {
-    const struct stash *st = st_;
+    const struct stash *st = (const void *) map->stash;
     __m128i xcmp1 = _mm_cmpeq_epi32(st->xtag, _mm_set1_epi32(tag));
     __m128i xcmp2 = _mm_cmpeq_epi32(st->xi1, _mm_set1_epi32(i1));
     unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(xcmp1, xcmp2)));
     _mm_storeu_si128(mpos, _mm_shuffle_epi8(st->xpos, lut.leftpack[mask]));
+    STAT(map, sthits, popcnt4(mask));
     return popcnt4(mask);
 }
 
@@ -186,7 +281,7 @@ static unsigned FASTCALL fp47m_find2st1_sse4(uint64_t fp, const struct fp47map *
     __m128 *bb = map->bb;
     unsigned n = find2(bb[i1], bb[i2], tag, mpos);
     i1 = (i1 < i2) ? i1 : i2;
-    return n + findst1(map->stash, i1, tag, mpos + n);
+    return n + findst1(map, i1, tag, mpos + n);
 }
 
 static unsigned FASTCALL fp47m_find2st4_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
@@ -195,61 +290,212 @@ static unsigned FASTCALL fp47m_find2st4_sse4(uint64_t fp, const struct fp47map *
     __m128 *bb = map->bb;
     unsigned n = find2(bb[i1], bb[i2], tag, mpos);
     i1 = (i1 < i2) ? i1 : i2;
-    return n + findst4(map->stash, i1, tag, mpos + n);
+    return n + findst4(map, i1, tag, mpos + n);
 }
 
 static unsigned FASTCALL fp47m_find4_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    return   n + find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
+    return find4x2(&bb[i1], &bb[i2], tag, mpos);
 }
 
 static unsigned FASTCALL fp47m_find4st1_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    n += find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
     i1 = (i1 < i2) ? i1 : i2;
-    return n + findst1(map->stash, i1, tag, mpos + n);
+    return n + findst1(map, i1, tag, mpos + n);
 }
 
 static unsigned FASTCALL fp47m_find4st4_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    n += find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
     i1 = (i1 < i2) ? i1 : i2;
-    return n + findst4(map->stash, i1, tag, mpos + n);
+    return n + findst4(map, i1, tag, mpos + n);
 }
 
 static unsigned FASTCALL fp47m_find4re_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I; ResizeI;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    return   n + find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
+    return find4x2(&bb[i1], &bb[i2], tag, mpos);
 }
 
 static unsigned FASTCALL fp47m_find4st1re_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I; ResizeI;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    n += find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
-    return n + findst1(map->stash, i1, tag, mpos + n);
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
+    return n + findst1(map, i1, tag, mpos + n);
 }
 
 static unsigned FASTCALL fp47m_find4st4re_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
 {
     dFP2I; ResizeI;
     struct buck4 *bb = map->bb;
-    unsigned n = find4(bb[i1].xtag, bb[i1].xpos, tag, mpos);
-    n += find4(bb[i2].xtag, bb[i2].xpos, tag, mpos + n);
-    return n + findst4(map->stash, i1, tag, mpos + n);
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
+    return n + findst4(map, i1, tag, mpos + n);
+}
+
+static unsigned FASTCALL fp47m_find4mg_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI; MigI;
+    struct buck4 *bb = map->bb;
+    return find4x2(&bb[i1], &bb[i2], tag, mpos);
+}
+
+// The stash is checked with i1 as seen by ResizeI.
+static unsigned FASTCALL fp47m_find4st1mg_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    struct buck4 *bb = map->bb;
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
+    return n + findst1(map, si1, tag, mpos + n);
+}
+
+static unsigned FASTCALL fp47m_find4st4mg_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    struct buck4 *bb = map->bb;
+    unsigned n = find4x2(&bb[i1], &bb[i2], tag, mpos);
+    return n + findst4(map, si1, tag, mpos + n);
+}
+
+#ifdef FP47M_AVX512
+// dFP2I (and ResizeI) for 8 fingerprints at once; mod32 is computed
+// in the 32-bit lanes.  The keys beyond n are loaded as zeros.
+static inline void dFP2I8(const struct fp47map *map, const uint64_t *fps, size_t n, bool re,
+	uint32_t *i1, uint32_t *i2, uint32_t *tag)
+{
+    __mmask8 kload = (n < 8) ? (1U << n) - 1 : 255;
+    __m512i zfp = _mm512_maskz_loadu_epi64(kload, fps);
+    __m256i yhi = _mm512_cvtepi64_epi32(_mm512_srli_epi64(zfp, 32));
+    __m256i ylo = _mm512_cvtepi64_epi32(zfp);
+    __m256i yone = _mm256_set1_epi32(1);
+    ylo = _mm256_max_epu32(_mm256_add_epi32(ylo, yone), yone);
+    ylo = _mm256_add_epi32(ylo, yhi);
+    ylo = _mm256_mask_add_epi32(ylo, _mm256_cmplt_epu32_mask(ylo, yhi), ylo, yone);
+    __m256i ymask0 = _mm256_set1_epi32(map->mask0);
+    __m256i yi1 = _mm256_and_si256(yhi, ymask0);
+    __m256i yi2 = _mm256_and_si256(_mm256_xor_si256(yhi, YXD(ylo)), ymask0);
+    if (re) {
+	__m256i ymask1 = _mm256_set1_epi32(map->mask1);
+	yi1 = _mm256_min_epu32(yi1, yi2);
+	yi1 = _mm256_or_si256(yi1, _mm256_sll_epi32(ylo, _mm_cvtsi32_si128(map->logsize0)));
+	yi2 = _mm256_and_si256(_mm256_xor_si256(yi1, YXD(ylo)), ymask1);
+	yi1 = _mm256_and_si256(yi1, ymask1);
+    }
+    _mm256_storeu_si256((void *) i1, yi1);
+    _mm256_storeu_si256((void *) i2, yi2);
+    _mm256_storeu_si256((void *) tag, ylo);
+}
+
+// Batch lookup, 8 keys per step: the indexes for the next 8 keys are
+// computed and their buckets prefetched, then the current 8 keys are
+// resolved with find4x2.  The stash variant (nst = 0, 1, 4) is a constant.
+static inline void find_batch8(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound, bool re, int nst)
+{
+    uint32_t i1[2][8], i2[2][8], tag[2][8];
+    struct buck4 *bb = map->bb;
+    dFP2I8(map, fps, n, re, i1[0], i2[0], tag[0]);
+    for (unsigned j = 0; j < 8; j++) {
+	__builtin_prefetch(&bb[i1[0][j]]);
+	__builtin_prefetch(&bb[i2[0][j]]);
+    }
+    for (size_t i = 0; i < n; i += 8) {
+	unsigned c = i / 8 % 2;
+	if (i + 8 < n) {
+	    dFP2I8(map, fps + i + 8, n - i - 8, re, i1[!c], i2[!c], tag[!c]);
+	    for (unsigned j = 0; j < 8; j++) {
+		__builtin_prefetch(&bb[i1[!c][j]]);
+		__builtin_prefetch(&bb[i2[!c][j]]);
+	    }
+	}
+	unsigned m = (n - i < 8) ? n - i : 8;
+	for (unsigned j = 0; j < m; j++) {
+	    uint32_t j1 = i1[c][j], j2 = i2[c][j], jtag = tag[c][j];
+	    uint32_t *jpos = mpos[i+j];
+	    unsigned k = find4x2(&bb[j1], &bb[j2], jtag, jpos);
+	    if (nst) {
+		j1 = re ? j1 : (j1 < j2) ? j1 : j2;
+		k += (nst == 1) ? findst1(map, j1, jtag, jpos + k)
+				: findst4(map, j1, jtag, jpos + k);
+	    }
+	    nfound[i+j] = k;
+	}
+    }
+}
+#endif
+
+void FASTCALL FLATTEN fp47m_find_batch2_sse4(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2_sse4, fp47m_find2_sse4);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2_sse4, fp47m_find2st1_sse4);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2_sse4, fp47m_find2st4_sse4);
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4_sse4(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+#ifdef FP47M_AVX512
+    if (likely(map->nstash == 0))
+	find_batch8(map, fps, n, mpos, nfound, false, 0);
+    else if (map->nstash == 1)
+	find_batch8(map, fps, n, mpos, nfound, false, 1);
+    else
+	find_batch8(map, fps, n, mpos, nfound, false, 4);
+#else
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4_sse4, fp47m_find4_sse4);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4_sse4, fp47m_find4st1_sse4);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4_sse4, fp47m_find4st4_sse4);
+#endif
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4re_sse4(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+#ifdef FP47M_AVX512
+    if (likely(map->nstash == 0))
+	find_batch8(map, fps, n, mpos, nfound, true, 0);
+    else if (map->nstash == 1)
+	find_batch8(map, fps, n, mpos, nfound, true, 1);
+    else
+	find_batch8(map, fps, n, mpos, nfound, true, 4);
+#else
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re_sse4, fp47m_find4re_sse4);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re_sse4, fp47m_find4st1re_sse4);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re_sse4, fp47m_find4st4re_sse4);
+#endif
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4mg_sse4(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg_sse4, fp47m_find4mg_sse4);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg_sse4, fp47m_find4st1mg_sse4);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg_sse4, fp47m_find4st4mg_sse4);
 }
 
 static inline bool insert2(union buck2 *b1, union buck2 *b2, uint32_t tag, uint32_t pos)
@@ -282,38 +528,78 @@ static inline bool insert4(struct buck4 *b1, struct buck4 *b2, uint32_t tag, uin
     return false;
 }
 
-static inline bool kickloop2(union buck2 *bb, union buck2 *b1,
+// Returns the number of kicks, or 0 if ran out of tries.
+static inline int kickloop2(union buck2 *bb, union buck2 *b1,
 	uint32_t *i1, uint32_t *tag, uint32_t *pos, uint32_t mask, int maxkick)
 {
     __m128i kbe = _mm_cvtsi32_si128(*tag);
     kbe = _mm_insert_epi32(kbe, *pos, 1);
 #define i1 (*i1)
+    int nk = 0;
     do {
+	nk++;
 	__m128i obe = b1->x;
-	i1 ^= b1->be[0].tag;
+	i1 ^= XD(b1->be[0].tag);
 	b1->x = _mm_alignr_epi8(kbe, obe, 8);
 	i1 &= mask;
 	b1 = &bb[i1];
-	if (b1->be[0].tag == 0) return _mm_storel_epi64((void *) &b1->be[0], obe), true;
-	if (b1->be[1].tag == 0) return _mm_storel_epi64((void *) &b1->be[1], obe), true;
+	if (b1->be[0].tag == 0) return _mm_storel_epi64((void *) &b1->be[0], obe), nk;
+	if (b1->be[1].tag == 0) return _mm_storel_epi64((void *) &b1->be[1], obe), nk;
 	kbe = obe;
-    } while (--maxkick >= 0);
+    } while (nk <= maxkick);
 #undef i1
     *tag = _mm_cvtsi128_si32(kbe);
     *pos = _mm_extract_epi32(kbe, 1);
-    return false;
+    return 0;
 }
 
-static inline bool kickloop4(struct buck4 *bb, struct buck4 *b1,
+#ifdef FP47M_AVX2
+// The whole bucket, tags and positions, is handled as a single ymm register:
+// the entries are rotated by vpermd, and the new entry is blended in.
+static inline int kickloop4(struct buck4 *bb, struct buck4 *b1,
+	uint32_t *i1, uint32_t *tag, uint32_t *pos, uint32_t mask, int maxkick)
+{
+    __m256i kbe = _mm256_setr_epi32(0, 0, 0, *tag, 0, 0, 0, *pos);
+    __m256i yrot = _mm256_setr_epi32(1, 2, 3, 3, 5, 6, 7, 7);
+    __m256i ybot = _mm256_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4);
+#define i1 (*i1)
+    int nk = 0;
+    do {
+	nk++;
+	__m256i obe = _mm256_loadu_si256((void *) b1);
+	i1 ^= XD(b1->tag[0]);
+	_mm256_storeu_si256((void *) b1,
+		_mm256_blend_epi32(_mm256_permutevar8x32_epi32(obe, yrot), kbe, 0x88));
+	i1 &= mask;
+	kbe = _mm256_permutevar8x32_epi32(obe, ybot);
+	b1 = &bb[i1];
+	__m128i xcmp = _mm_cmpeq_epi32(b1->xtag, _mm_setzero_si128());
+	unsigned slots = _mm_movemask_epi8(xcmp);
+	if (likely(slots)) {
+	    unsigned slot1 = ctz32(slots);
+	    b1->tag[slot1>>2] = _mm256_cvtsi256_si32(kbe);
+	    b1->pos[slot1>>2] = _mm256_extract_epi32(kbe, 4);
+	    return nk;
+	}
+    } while (nk <= maxkick);
+#undef i1
+    *tag = _mm256_cvtsi256_si32(kbe);
+    *pos = _mm256_extract_epi32(kbe, 4);
+    return 0;
+}
+#else
+static inline int kickloop4(struct buck4 *bb, struct buck4 *b1,
 	uint32_t *i1, uint32_t *tag, uint32_t *pos, uint32_t mask, int maxkick)
 {
     __m128i ktag = _mm_cvtsi32_si128(*tag);
     __m128i kpos = _mm_cvtsi32_si128(*pos);
 #define i1 (*i1)
+    int nk = 0;
     do {
+	nk++;
 	__m128i otag = b1->xtag;
 	__m128i opos = b1->xpos;
-	i1 ^= b1->tag[0];
+	i1 ^= XD(b1->tag[0]);
 	b1->xtag = _mm_alignr_epi8(ktag, otag, 4);
 	b1->xpos = _mm_alignr_epi8(kpos, opos, 4);
 	i1 &= mask;
@@ -324,14 +610,48 @@ static inline bool kickloop4(struct buck4 *bb, struct buck4 *b1,
 	    unsigned slot1 = ctz32(slots);
 	    b1->tag[slot1>>2] = _mm_cvtsi128_si32(otag);
 	    b1->pos[slot1>>2] = _mm_cvtsi128_si32(opos);
-	    return true;
+	    return nk;
 	}
 	ktag = otag, kpos = opos;
-    } while (--maxkick >= 0);
+    } while (nk <= maxkick);
 #undef i1
     *tag = _mm_cvtsi128_si32(ktag);
     *pos = _mm_cvtsi128_si32(kpos);
-    return false;
+    return 0;
+}
+#endif
+
+// The kick loop while splitting the buckets.
+static inline int kickloopmg(const struct fp47map *map, struct buck4 *bb, struct buck4 *b1,
+	uint32_t *i1, uint32_t *tag, uint32_t *pos)
+{
+    __m128i ktag = _mm_cvtsi32_si128(*tag);
+    __m128i kpos = _mm_cvtsi32_si128(*pos);
+    int maxkick = map->maxkick;
+    int nk = 0;
+#define i1 (*i1)
+    do {
+	nk++;
+	__m128i otag = b1->xtag;
+	__m128i opos = b1->xpos;
+	b1->xtag = _mm_alignr_epi8(ktag, otag, 4);
+	b1->xpos = _mm_alignr_epi8(kpos, opos, 4);
+	i1 = migalt(map, i1, _mm_cvtsi128_si32(otag));
+	b1 = &bb[i1];
+	__m128i xcmp = _mm_cmpeq_epi32(b1->xtag, _mm_setzero_si128());
+	unsigned slots = _mm_movemask_epi8(xcmp);
+	if (likely(slots)) {
+	    unsigned slot1 = ctz32(slots);
+	    b1->tag[slot1>>2] = _mm_cvtsi128_si32(otag);
+	    b1->pos[slot1>>2] = _mm_cvtsi128_si32(opos);
+	    return nk;
+	}
+	ktag = otag, kpos = opos;
+    } while (nk <= maxkick);
+#undef i1
+    *tag = _mm_cvtsi128_si32(ktag);
+    *pos = _mm_cvtsi128_si32(kpos);
+    return 0;
 }
 
 static inline bool putstash(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos,
@@ -345,6 +665,7 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, uint32_t tag, uint
 	st->xtag = _mm_cvtsi32_si128(tag);
 	map->find = find_st1;
 	map->nstash = 1, map->cnt--;
+	STAT(map, stashed, 1);
 	return true;
     }
     if (likely(map->nstash < 4)) {
@@ -353,6 +674,7 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, uint32_t tag, uint
 	st->tag[map->nstash] = tag;
 	map->find = find_st4;
 	map->nstash++, map->cnt--;
+	STAT(map, stashed, 1);
 	return true;
     }
     return false;
@@ -360,7 +682,8 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, uint32_t tag, uint
 
 // Turn an array of 2 entries per bucket (buck2) into an array
 // of 4 non-interleaved entries per bucket (buck4).
-static inline void reinterp24(__m128i *bb, size_t nb, __m128i *bb4)
+// Convert the buckets [lo,hi), top down (which works in place).
+static inline void reinterp24(__m128i *bb, size_t lo, size_t hi, __m128i *bb4)
 {
     //                       p1b p3b  .  .        .   .   .   .
     //                       t1b t3b  .  .        .   .   .   .
@@ -371,7 +694,7 @@ static inline void reinterp24(__m128i *bb, size_t nb, __m128i *bb4)
     //  p0a p1a p2a p3a      p0a p2a  .  .       t0b t1b t2b t3b
     //  t0a t1a t2a t3a      t0a t2a  .  .       t0a t1a t2a t3a
 
-    for (size_t i = nb; i; i -= 2) {
+    for (size_t i = hi; i > lo; i -= 2) {
 	__m128i b2 = bb[i-2];
 	__m128i b3 = bb[i-1];
 	__m128i t2 = _mm_shuffle_epi8(b2, _mm_setr_epi32(0x03020100, 0x0b0a0908, -1, -1));
@@ -385,21 +708,22 @@ static inline void reinterp24(__m128i *bb, size_t nb, __m128i *bb4)
     }
 }
 
+// Split the buckets [lo,hi) of nb into bb4 (which can be the same as bb).
 static inline void reinterp44(struct buck4 *bb, size_t nb, struct buck4 *bb4,
-	uint32_t mask0, uint32_t mask1)
+	size_t lo, size_t hi, uint32_t mask0, uint32_t mask1)
 {
     struct buck4 *bb8 = bb4 + nb;
     __m128i xmul = _mm_set1_epi32(mask0 + 1);
     __m128i xmask0 = _mm_set1_epi32(mask0);
     __m128i xmask1 = _mm_set1_epi32(mask1);
-    for (size_t i = 0; i < nb; i++) {
+    for (size_t i = lo; i < hi; i++) {
 	__m128i xtag = bb[i].xtag;
 	__m128i xhi = _mm_mullo_epi32(xtag, xmul);
 	__m128i xi1 = _mm_set1_epi32(i & mask0);
-	__m128i xi2 = _mm_and_si128(_mm_xor_si128(xi1, xtag), xmask0);
+	__m128i xi2 = _mm_and_si128(_mm_xor_si128(xi1, XXD(xtag)), xmask0);
 	xi1 = _mm_blendv_epi8(xi1, xi2, _mm_cmpgt_epi32(xi1, xi2));
 	xi1 = _mm_or_si128(xi1, xhi);
-	xi2 = _mm_xor_si128(xi1, xtag);
+	xi2 = _mm_xor_si128(xi1, XXD(xtag));
 	xi1 = _mm_and_si128(xi1, xmask1);
 	xi2 = _mm_and_si128(xi2, xmask1);
 	__m128i xi = _mm_set1_epi32(i);
@@ -416,8 +740,63 @@ static inline void reinterp44(struct buck4 *bb, size_t nb, struct buck4 *bb4,
     }
 }
 
+// The conversions are run in parallel on big maps.
+struct re24arg {
+    __m128i *bb, *bb4;
+};
+
+static void re24(void *arg, size_t lo, size_t hi)
+{
+    const struct re24arg *a = arg;
+    reinterp24(a->bb, lo, hi, a->bb4);
+}
+
+// In place, the upper half of the buckets is converted first (into the new
+// memory), then the upper half of the rest (into the vacated space), etc.
+static void reinterp24p(const struct fp47map *map, __m128i *bb, size_t nb, __m128i *bb4)
+{
+    struct re24arg a = { bb, bb4 };
+    size_t hi = nb;
+    if (bb == bb4)
+	for (; hi > PARMIN; hi /= 2)
+	    fp47m_parallel(map, hi / 2, hi, re24, &a);
+    fp47m_parallel(map, 0, hi, re24, &a);
+}
+
+struct re44arg {
+    struct buck4 *bb, *bb4;
+    size_t nb;
+    uint32_t mask0, mask1;
+};
+
+static void re44(void *arg, size_t lo, size_t hi)
+{
+    const struct re44arg *a = arg;
+    reinterp44(a->bb, a->nb, a->bb4, lo, hi, a->mask0, a->mask1);
+}
+
+static void reinterp44p(const struct fp47map *map, struct buck4 *bb, size_t nb, struct buck4 *bb4,
+	size_t lo, size_t hi)
+{
+    struct re44arg a = { bb, bb4, nb, map->mask0, map->mask1 };
+    fp47m_parallel(map, lo, hi, re44, &a);
+}
+
 static int FASTCALL fp47m_insert4_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
 static int FASTCALL fp47m_insert4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_insert_batch4_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_insert_batch4re_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_erase4_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_erase4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_replace4_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
+static int FASTCALL fp47m_replace4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
+static int FASTCALL fp47m_insert4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_insert_batch4mg_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_erase4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_replace4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
 
 struct re5 {
     union {
@@ -434,7 +813,7 @@ struct re5 {
     };
 };
 
-// Reinsert the stashed entries and the pending entry.
+// Reinsert the stashed entries and the pending entry (if tag != 0).
 static inline bool restash(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos, bool re)
 {
     struct re5 re5, ore;
@@ -444,29 +823,27 @@ static inline bool restash(struct fp47map *map, uint32_t i1, uint32_t tag, uint3
     re5.i1[n] = i1, re5.tag[n] = tag, re5.pos[n] = pos;
     ore.xi1 = ore.xtag = ore.xpos = _mm_setzero_si128();
     struct buck4 *bb = map->bb;
-    unsigned oj = 0;
-    for (unsigned j = 0; j <= n; j++) {
+    unsigned oj = 0, nj = n + (tag != 0);
+    for (unsigned j = 0; j < nj; j++) {
 	i1 = re5.i1[j], tag = re5.tag[j], pos = re5.pos[j];
 	uint32_t i2;
 	if (re) {
 	    i1 |= tag << map->logsize0;
-	    i2 = (i1 ^ tag) & map->mask1;
+	    i2 = (i1 ^ XD(tag)) & map->mask1;
 	    i1 &= map->mask1;
 	}
 	else
-	    i2 = (i1 ^ tag) & map->mask0;
+	    i2 = (i1 ^ XD(tag)) & map->mask0;
 	struct buck4 *b1 = &bb[i1];
 	if (insert4(b1, &bb[i2], tag, pos))
 	    continue;
 	unsigned mask = re ? map->mask1 : map->mask0;
-	if (kickloop4(bb, b1, &i1, &tag, &pos, mask, map->maxkick))
+	if (kicked(map, kickloop4(bb, b1, &i1, &tag, &pos, mask, map->maxkick)))
 	    continue;
-	if (re) {
-	    i2 = (i1 ^ tag) & map->mask1;
-	    i1 = ((i1 & map->mask0) < (i2 & map->mask0)) ? i1 : i2;
-	}
+	if (re)
+	    i1 = reI(map, i1, tag);
 	else {
-	    i2 = (i1 ^ tag) & map->mask0;
+	    i2 = (i1 ^ XD(tag)) & map->mask0;
 	    i1 = (i1 < i2) ? i1 : i2;
 	}
 	ore.i1[oj] = i1, ore.tag[oj] = tag, ore.pos[oj++] = pos;
@@ -486,48 +863,70 @@ static inline bool restash(struct fp47map *map, uint32_t i1, uint32_t tag, uint3
     return true;
 }
 
-static NOINLINE int fp47m_resize2_sse4(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos)
+static inline int resize2(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos)
 {
     if (sizeof(size_t) < 5 && map->logsize0 == 27)
 	return -2;
     size_t nb = map->mask0 + (size_t) 1;
-    void *bb = allocX2(&map->bb, nb * 16);
+    void *bb = allocX2(map, nb * 16);
     if (!bb)
 	return -2;
-    reinterp24(map->bb, nb, bb);
+    reinterp24p(map, map->bb, nb, bb);
     if (map->bb != bb)
-	free(map->bb), map->bb = bb;
+	freebb(map, map->bb, nb * 16), map->bb = bb;
     map->bsize = 4;
-    map->find = fp47m_find4_sse4;
-    map->insert = fp47m_insert4_sse4;
-    map->prefetch = fp47m_prefetch4_sse4;
-    if (restash(map, i1, tag, pos, false))
+    SetVF(map, 4, _sse4);
+    if (TIMED(map, restash_ns, restash(map, i1, tag, pos, false)))
 	return 2;
     return -1;
 }
 
-static NOINLINE int fp47m_resize4_sse4(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos)
+// With incr, the buckets which have grown in place are split later, on insert,
+// and the pending entry is stashed in the meantime.
+static inline int resize4(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos, bool incr)
 {
     if (map->logsize1 == ((sizeof(size_t) < 5) ? 26 : 32))
 	return -2;
     size_t nb = map->mask1 + (size_t) 1;
-    void *bb = allocX2(&map->bb, nb * 32);
+    void *bb = allocX2(map, nb * 32);
     if (!bb)
 	return -2;
     map->mask1 = map->mask1 << 1 | 1;
     map->logsize1++;
-    map->maxkick = logsize2maxkick(map->logsize1);
-    reinterp44(map->bb, nb, bb, map->mask0, map->mask1);
+    setmaxkick(map);
+    if (incr && map->bb == bb && tag && map->nstash < 4) {
+	struct stash *st = (void *) &map->stash;
+	for (unsigned j = 0; j < map->nstash; j++)
+	    st->i1[j] = reI(map, st->i1[j], st->tag[j]);
+	map->mig = nb;
+	SetVF(map, 4mg, _sse4);
+	putstash(map, reI(map, i1, tag), tag, pos, fp47m_find4st1mg_sse4, fp47m_find4st4mg_sse4);
+	return 2;
+    }
+    reinterp44p(map, map->bb, nb, bb, 0, nb);
     if (map->bb != bb)
-	free(map->bb), map->bb = bb;
-    map->find = fp47m_find4re_sse4;
-    map->insert = fp47m_insert4re_sse4;
-    map->prefetch = fp47m_prefetch4re_sse4;
-    if (restash(map, i1, tag, pos, true))
+	freebb(map, map->bb, nb * 32), map->bb = bb;
+    SetVF(map, 4re, _sse4);
+    if (TIMED(map, restash_ns, restash(map, i1, tag, pos, true)))
 	return 2;
     return -1;
 }
 
+static NOINLINE int fp47m_resize2_sse4(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos)
+{
+    int rc = TIMED(map, resize_ns, resize2(map, i1, tag, pos));
+    STAT(map, resizes, rc > 0);
+    return rc;
+}
+
+static NOINLINE int fp47m_resize4_sse4(struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos,
+	bool incr)
+{
+    int rc = TIMED(map, resize_ns, resize4(map, i1, tag, pos, incr));
+    STAT(map, resizes, rc > 0);
+    return rc;
+}
+
 int FASTCALL fp47m_insert2_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
 {
     dFP2I;
@@ -536,10 +935,12 @@ int FASTCALL fp47m_insert2_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
     map->cnt++;
     if (insert2(b1, &bb[i2], tag, pos))
 	return 1;
-    if (likely(!full2(map->cnt, map->mask0))) {
-	if (kickloop2(bb, b1, &i1, &tag, &pos, map->mask0, map->maxkick))
+    if (likely(!full2(map->cnt, map->mask0, map->load2))) {
+	if (nearfull(map->cnt, 2, map->mask0, map->load2) && bfs(map, i1, i2, tag, pos, map->mask0))
+	    return 1;
+	if (kicked(map, kickloop2(bb, b1, &i1, &tag, &pos, map->mask0, map->maxkick)))
 	    return 1;
-	i2 = (i1 ^ tag) & map->mask0;
+	i2 = (i1 ^ XD(tag)) & map->mask0;
 	i1 = (i1 < i2) ? i1 : i2;
 	if (putstash(map, i1, tag, pos, fp47m_find2st1_sse4, fp47m_find2st4_sse4))
 	    return 1;
@@ -557,19 +958,21 @@ static int FASTCALL fp47m_insert4_sse4(uint64_t fp, struct fp47map *map, uint32_
     map->cnt++;
     if (insert4(b1, &bb[i2], tag, pos))
 	return 1;
-    if (likely(!full4(map->cnt, map->mask0))) {
-	if (kickloop4(bb, b1, &i1, &tag, &pos, map->mask0, map->maxkick))
+    if (likely(!full4(map->cnt, map->mask0, map->load4))) {
+	if (nearfull(map->cnt, 4, map->mask0, map->load4) && bfs(map, i1, i2, tag, pos, map->mask0))
+	    return 1;
+	if (kicked(map, kickloop4(bb, b1, &i1, &tag, &pos, map->mask0, map->maxkick)))
 	    return 1;
-	i2 = (i1 ^ tag) & map->mask0;
+	i2 = (i1 ^ XD(tag)) & map->mask0;
 	i1 = (i1 < i2) ? i1 : i2;
-	if (putstash(map, i1, tag, pos, fp47m_find4st1_sse4, fp47m_find4st4_sse4))
+	if (stashok(map) && putstash(map, i1, tag, pos, fp47m_find4st1_sse4, fp47m_find4st4_sse4))
 	    return 1;
-	if (map->cnt / 2 <= map->mask0)
+	if (broken4(map->cnt, map->mask0))
 	    return -1;
     }
     else
 	i1 = (i1 < i2) ? i1 : i2;
-    return fp47m_resize4_sse4(map, i1, tag, pos);
+    return fp47m_resize4_sse4(map, i1, tag, pos, map->incr);
 }
 
 static int FASTCALL fp47m_insert4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
@@ -580,15 +983,544 @@ static int FASTCALL fp47m_insert4re_sse4(uint64_t fp, struct fp47map *map, uint3
     map->cnt++;
     if (insert4(b1, &bb[i2], tag, pos))
 	return 1;
-    if (likely(!full4(map->cnt, map->mask1))) {
-	if (kickloop4(bb, b1, &i1, &tag, &pos, map->mask1, map->maxkick))
+    if (likely(!full4(map->cnt, map->mask1, map->load4))) {
+	if (nearfull(map->cnt, 4, map->mask1, map->load4) && bfs(map, i1, i2, tag, pos, map->mask1))
 	    return 1;
-	i2 = (i1 ^ tag) & map->mask1;
-	i1 = ((i1 & map->mask0) < (i2 & map->mask0)) ? i1 : i2;
-	if (putstash(map, i1, tag, pos, fp47m_find4st1re_sse4, fp47m_find4st4re_sse4))
+	if (kicked(map, kickloop4(bb, b1, &i1, &tag, &pos, map->mask1, map->maxkick)))
 	    return 1;
-	if (map->cnt / 2 <= map->mask1)
+	i1 = reI(map, i1, tag);
+	if (stashok(map) && putstash(map, i1, tag, pos, fp47m_find4st1re_sse4, fp47m_find4st4re_sse4))
+	    return 1;
+	if (broken4(map->cnt, map->mask1))
 	    return -1;
     }
-    return fp47m_resize4_sse4(map, i1, tag, pos);
+    return fp47m_resize4_sse4(map, i1, tag, pos, map->incr);
+}
+
+int FASTCALL FLATTEN fp47m_insert_batch2_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch2_sse4, fp47m_insert2_sse4);
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4_sse4, fp47m_insert4_sse4);
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4re_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4re_sse4, fp47m_insert4re_sse4);
+}
+
+// Locate the entry with the given tag and position.
+static inline union bent *findbe2(union buck2 *b1, union buck2 *b2, uint32_t tag, uint32_t pos)
+{
+    union bent kbe = { .tag = tag, .pos = pos };
+    if (b1->be[0].u64 == kbe.u64) return &b1->be[0];
+    if (b2->be[0].u64 == kbe.u64) return &b2->be[0];
+    if (b1->be[1].u64 == kbe.u64) return &b1->be[1];
+    if (b2->be[1].u64 == kbe.u64) return &b2->be[1];
+    return NULL;
+}
+
+static inline struct buck4 *findbe4(struct buck4 *b1, struct buck4 *b2,
+	uint32_t tag, uint32_t pos, unsigned *slot)
+{
+    __m128i xtag = _mm_set1_epi32(tag);
+    __m128i xpos = _mm_set1_epi32(pos);
+    __m128i xcmp1 = _mm_and_si128(_mm_cmpeq_epi32(b1->xtag, xtag), _mm_cmpeq_epi32(b1->xpos, xpos));
+    __m128i xcmp2 = _mm_and_si128(_mm_cmpeq_epi32(b2->xtag, xtag), _mm_cmpeq_epi32(b2->xpos, xpos));
+    unsigned mask1 = _mm_movemask_ps(_mm_castsi128_ps(xcmp1));
+    unsigned mask2 = _mm_movemask_ps(_mm_castsi128_ps(xcmp2));
+    if (likely(mask1))
+	return *slot = ctz32(mask1), b1;
+    if (likely(mask2))
+	return *slot = ctz32(mask2), b2;
+    return NULL;
+}
+
+// Remove the j-th stashed entry, shifting down the rest of the stash
+// (the st1 variant only checks the first slot).
+static inline void delstash(struct fp47map *map, unsigned j,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    struct stash *st = (void *) &map->stash;
+    unsigned n = --map->nstash;
+    for (; j < n; j++) {
+	st->i1[j] = st->i1[j+1];
+	st->tag[j] = st->tag[j+1];
+	st->pos[j] = st->pos[j+1];
+    }
+    st->i1[n] = st->tag[n] = st->pos[n] = 0;
+    if (n == 0)
+	map->find = find_st0;
+    else if (n == 1)
+	map->find = find_st1;
+}
+
+// A slot has been freed, try to move the stashed entries back to the buckets.
+static inline void unstash(int bsize, struct fp47map *map, bool re,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; ) {
+	uint32_t i1 = st->i1[j], tag = st->tag[j], i2;
+	if (re) {
+	    i1 |= tag << map->logsize0;
+	    i2 = (i1 ^ XD(tag)) & map->mask1;
+	    i1 &= map->mask1;
+	}
+	else
+	    i2 = (i1 ^ XD(tag)) & map->mask0;
+	bool ok;
+	if (bsize == 2) {
+	    union buck2 *bb = map->bb;
+	    ok = insert2(&bb[i1], &bb[i2], tag, st->pos[j]);
+	}
+	else {
+	    struct buck4 *bb = map->bb;
+	    ok = insert4(&bb[i1], &bb[i2], tag, st->pos[j]);
+	}
+	if (ok)
+	    delstash(map, j, find_st0, find_st1), map->cnt++;
+	else
+	    j++;
+    }
+}
+
+// The stash index si1 is i1 as seen by findst1/findst4.
+static inline int erase(int bsize, struct fp47map *map, uint32_t i1, uint32_t i2,
+	uint32_t si1, uint32_t tag, uint32_t pos, bool re,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    bool found = false;
+    if (bsize == 2) {
+	union buck2 *bb = map->bb;
+	union bent *be = findbe2(&bb[i1], &bb[i2], tag, pos);
+	if (likely(be))
+	    be->u64 = 0, found = true;
+    }
+    else {
+	struct buck4 *bb = map->bb, *b;
+	unsigned slot;
+	b = findbe4(&bb[i1], &bb[i2], tag, pos, &slot);
+	if (likely(b))
+	    b->tag[slot] = b->pos[slot] = 0, found = true;
+    }
+    if (likely(found)) {
+	map->cnt--;
+	if (unlikely(map->nstash))
+	    unstash(bsize, map, re, find_st0, find_st1);
+	return 1;
+    }
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->tag[j] == tag && st->pos[j] == pos && st->i1[j] == si1)
+	    return delstash(map, j, find_st0, find_st1), 1;
+    return 0;
+}
+
+static inline int replace(int bsize, struct fp47map *map, uint32_t i1, uint32_t i2,
+	uint32_t si1, uint32_t tag, uint32_t pos, uint32_t newpos)
+{
+    if (bsize == 2) {
+	union buck2 *bb = map->bb;
+	union bent *be = findbe2(&bb[i1], &bb[i2], tag, pos);
+	if (likely(be))
+	    return be->pos = newpos, 1;
+    }
+    else {
+	struct buck4 *bb = map->bb, *b;
+	unsigned slot;
+	b = findbe4(&bb[i1], &bb[i2], tag, pos, &slot);
+	if (likely(b))
+	    return b->pos[slot] = newpos, 1;
+    }
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->tag[j] == tag && st->pos[j] == pos && st->i1[j] == si1)
+	    return st->pos[j] = newpos, 1;
+    return 0;
+}
+
+int FASTCALL fp47m_erase2_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I;
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return erase(2, map, i1, i2, si1, tag, pos, false, fp47m_find2_sse4, fp47m_find2st1_sse4);
+}
+
+static int FASTCALL fp47m_erase4_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I;
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return erase(4, map, i1, i2, si1, tag, pos, false, fp47m_find4_sse4, fp47m_find4st1_sse4);
+}
+
+static int FASTCALL fp47m_erase4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI;
+    return erase(4, map, i1, i2, i1, tag, pos, true, fp47m_find4re_sse4, fp47m_find4st1re_sse4);
+}
+
+int FASTCALL fp47m_replace2_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I;
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return replace(2, map, i1, i2, si1, tag, pos, newpos);
+}
+
+static int FASTCALL fp47m_replace4_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I;
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return replace(4, map, i1, i2, si1, tag, pos, newpos);
+}
+
+static int FASTCALL fp47m_replace4re_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I; ResizeI;
+    return replace(4, map, i1, i2, i1, tag, pos, newpos);
+}
+
+// Put back an entry squeezed out on shrink.  In the worst case,
+// when the stash is full, the map gets resized again.
+static inline int reput(int bsize, struct fp47map *map, uint32_t i1, uint32_t tag, uint32_t pos, bool re,
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st4)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    uint32_t i2;
+    uint32_t mask = re ? map->mask1 : map->mask0;
+    if (re)
+	i1 |= tag << map->logsize0;
+    i2 = (i1 ^ XD(tag)) & mask;
+    i1 &= mask;
+    map->cnt++;
+    if (bsize == 2) {
+	union buck2 *bb = map->bb;
+	if (insert2(&bb[i1], &bb[i2], tag, pos))
+	    return 1;
+	if (kicked(map, kickloop2(bb, &bb[i1], &i1, &tag, &pos, mask, map->maxkick)))
+	    return 1;
+    }
+    else {
+	struct buck4 *bb = map->bb;
+	if (insert4(&bb[i1], &bb[i2], tag, pos))
+	    return 1;
+	if (kicked(map, kickloop4(bb, &bb[i1], &i1, &tag, &pos, mask, map->maxkick)))
+	    return 1;
+    }
+    i2 = (i1 ^ XD(tag)) & mask;
+    i1 = re ? reI(map, i1, tag) : (i1 < i2) ? i1 : i2;
+    if (putstash(map, i1, tag, pos, find_st1, find_st4))
+	return 1;
+    if (bsize == 2)
+	return fp47m_resize2_sse4(map, i1, tag, pos);
+    return fp47m_resize4_sse4(map, i1, tag, pos, false);
+}
+
+static int reputs(struct fp47map *map, struct squeezed *sq, size_t n)
+{
+    int ret = 1;
+    for (size_t j = 0; j < n; j++) {
+	int rc;
+	uint32_t i1 = sq[j].i1, tag = sq[j].be.tag, pos = sq[j].be.pos;
+	if (map->bsize == 2)
+	    rc = reput(2, map, i1, tag, pos, false, fp47m_find2st1_sse4, fp47m_find2st4_sse4);
+	else if (map->logsize1 == map->logsize0)
+	    rc = reput(4, map, i1, tag, pos, false, fp47m_find4st1_sse4, fp47m_find4st4_sse4);
+	else
+	    rc = reput(4, map, i1, tag, pos, true, fp47m_find4st1re_sse4, fp47m_find4st4re_sse4);
+	if (rc < 0)
+	    return rc;
+	if (rc > ret)
+	    ret = rc;
+    }
+    return ret;
+}
+
+// Split the next n buckets.  Once done, switch to the 4re state, and try
+// to move the stashed entries to the buckets.  Returns true on the switch.
+static inline bool split(struct fp47map *map, size_t n)
+{
+    size_t nb = (map->mask1 >> 1) + (size_t) 1;
+    n = (n < map->mig) ? n : map->mig;
+    reinterp44p(map, map->bb, nb, map->bb, map->mig - n, map->mig);
+    map->mig -= n;
+    if (likely(map->mig))
+	return false;
+    SetVF(map, 4re, _sse4);
+    TIMED(map, restash_ns, restash(map, 0, 0, 0, true));
+    return true;
+}
+
+static int FASTCALL fp47m_insert4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI; MigI;
+    struct buck4 *bb = map->bb;
+    struct buck4 *b1 = &bb[i1];
+    map->cnt++;
+    if (insert4(b1, &bb[i2], tag, pos))
+	return split(map, MIGSTEP) ? 2 : 1;
+    if (likely(!full4(map->cnt, map->mask1, map->load4))) {
+	if (kicked(map, kickloopmg(map, bb, b1, &i1, &tag, &pos)))
+	    return split(map, MIGSTEP) ? 2 : 1;
+	if (putstash(map, reI(map, i1, tag), tag, pos, fp47m_find4st1mg_sse4, fp47m_find4st4mg_sse4))
+	    return split(map, MIGSTEP) ? 2 : 1;
+    }
+    // Complete the split, and then the pending entry goes the usual way.
+    map->cnt--;
+    split(map, map->mig);
+    int rc = reput(4, map, reI(map, i1, tag), tag, pos, true,
+	    fp47m_find4st1re_sse4, fp47m_find4st4re_sse4);
+    return rc < 0 ? rc : 2;
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4mg_sse4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4mg_sse4, fp47m_insert4mg_sse4);
+}
+
+// Unlike erase(), the stashed entries are not moved back to the buckets
+// until the split is complete.
+static int FASTCALL fp47m_erase4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    struct buck4 *bb = map->bb, *b;
+    unsigned slot;
+    b = findbe4(&bb[i1], &bb[i2], tag, pos, &slot);
+    if (likely(b)) {
+	b->tag[slot] = b->pos[slot] = 0;
+	map->cnt--;
+	return 1;
+    }
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->tag[j] == tag && st->pos[j] == pos && st->i1[j] == si1)
+	    return delstash(map, j, fp47m_find4mg_sse4, fp47m_find4st1mg_sse4), 1;
+    return 0;
+}
+
+static int FASTCALL fp47m_replace4mg_sse4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    return replace(4, map, i1, i2, si1, tag, pos, newpos);
+}
+
+static inline unsigned fill4(const struct buck4 *b)
+{
+    __m128i xcmp = _mm_cmpeq_epi32(b->xtag, _mm_setzero_si128());
+    return 4 - popcnt4(_mm_movemask_ps(_mm_castsi128_ps(xcmp)));
+}
+
+// Move the stashed entries to the squeezed list.
+static inline size_t unstash_all(struct fp47map *map, struct squeezed *sq)
+{
+    struct stash *st = (void *) &map->stash;
+    size_t n = map->nstash;
+    for (size_t j = 0; j < n; j++) {
+	sq[j].i1 = st->i1[j];
+	sq[j].be.tag = st->tag[j];
+	sq[j].be.pos = st->pos[j];
+    }
+    st->xi1 = st->xtag = st->xpos = _mm_setzero_si128();
+    map->nstash = 0;
+    return n;
+}
+
+// Undo resize4: merge the buckets i and i+nb back into i.
+static int shrink44(struct fp47map *map)
+{
+    size_t nb = (map->mask1 >> 1) + (size_t) 1;
+    struct buck4 *bb = map->bb;
+    size_t nsq = map->nstash;
+    for (size_t i = 0; i < nb; i++) {
+	unsigned k = fill4(&bb[i]) + fill4(&bb[i+nb]);
+	nsq += (k > 4) ? k - 4 : 0;
+    }
+    void *nbb;
+    struct squeezed *sq = malloc((nsq + 1) * sizeof *sq);
+    if (!sq || !allocD2(map, &nbb, nb * 64))
+	return free(sq), -2;
+    size_t n = unstash_all(map, sq);
+    uint32_t mask1 = map->mask1 >> 1;
+    for (size_t i = 0; i < nb; i++) {
+	struct buck4 b[2] = { bb[i], bb[i+nb] };
+	bb[i].xtag = bb[i].xpos = _mm_setzero_si128();
+	unsigned k = 0;
+	for (unsigned j = 0; j < 8; j++) {
+	    uint32_t tag = b[j>>2].tag[j&3];
+	    uint32_t pos = b[j>>2].pos[j&3];
+	    if (tag == 0)
+		continue;
+	    if (k < 4) {
+		bb[i].tag[k] = tag;
+		bb[i].pos[k++] = pos;
+		continue;
+	    }
+	    sq[n].i1 = reI(map, i, tag);
+	    sq[n].be.tag = tag;
+	    sq[n++].be.pos = pos;
+	    map->cnt--;
+	}
+    }
+    map->bb = freeD2(map, bb, nb * 64, nbb);
+    map->mask1 = mask1;
+    map->logsize1--;
+    setmaxkick(map);
+    if (map->logsize1 == map->logsize0)
+	SetVF(map, 4, _sse4);
+    else
+	SetVF(map, 4re, _sse4);
+    int rc = reputs(map, sq, n);
+    free(sq);
+    return rc;
+}
+
+// Undo resize2: keep two entries per bucket, interleaved.
+static int shrink24(struct fp47map *map)
+{
+    size_t nb = map->mask0 + (size_t) 1;
+    struct buck4 *bb = map->bb;
+    size_t nsq = map->nstash;
+    for (size_t i = 0; i < nb; i++) {
+	unsigned k = fill4(&bb[i]);
+	nsq += (k > 2) ? k - 2 : 0;
+    }
+    void *nbb;
+    struct squeezed *sq = malloc((nsq + 1) * sizeof *sq);
+    if (!sq || !allocD2(map, &nbb, nb * 32))
+	return free(sq), -2;
+    size_t n = unstash_all(map, sq);
+    union buck2 *bb2 = map->bb;
+    for (size_t i = 0; i < nb; i++) {
+	struct buck4 b = bb[i];
+	bb2[i].x = _mm_setzero_si128();
+	unsigned k = 0;
+	for (unsigned j = 0; j < 4; j++) {
+	    if (b.tag[j] == 0)
+		continue;
+	    if (k < 2) {
+		bb2[i].be[k].tag = b.tag[j];
+		bb2[i].be[k++].pos = b.pos[j];
+		continue;
+	    }
+	    uint32_t i1 = i, i2 = (i ^ XD(b.tag[j])) & map->mask0;
+	    sq[n].i1 = (i1 < i2) ? i1 : i2;
+	    sq[n].be.tag = b.tag[j];
+	    sq[n++].be.pos = b.pos[j];
+	    map->cnt--;
+	}
+    }
+    map->bb = freeD2(map, bb, nb * 32, nbb);
+    map->bsize = 2;
+    SetVF(map, 2, _sse4);
+    int rc = reputs(map, sq, n);
+    free(sq);
+    return rc;
+}
+
+int fp47m_shrink_sse4(struct fp47map *map)
+{
+    int ret = 0;
+    while (map->bsize == 4) {
+	size_t cnt = map->cnt + map->nstash;
+	int rc;
+	if (map->logsize1 > map->logsize0) {
+	    if (!low4(cnt, map->mask1 >> 1, map->load4))
+		break;
+	    rc = shrink44(map);
+	}
+	else {
+	    if (!low2(cnt, map->mask0, map->load2))
+		break;
+	    rc = shrink24(map);
+	}
+	if (rc != 1)
+	    return (rc < 0) ? rc : ret;
+	ret = 1;
+    }
+    return ret;
+}
+
+// Try harder to move the stashed entries to the buckets.
+int fp47m_drain_sse4(struct fp47map *map)
+{
+    struct squeezed sq[4];
+    uint8_t maxkick = map->maxkick;
+    size_t n = unstash_all(map, sq);
+    fp47m_setvf_sse4(map);
+    map->maxkick = 255;
+    int rc = reputs(map, sq, n);
+    map->maxkick = maxkick;
+    if (rc < 0)
+	return rc;
+    return map->nstash == 0;
+}
+
+// Grow the table in advance, so that it can hold n entries.
+int fp47m_reserve_sse4(struct fp47map *map, size_t n)
+{
+    int ret = 0;
+    while (1) {
+	int rc;
+	if (map->bsize == 2) {
+	    if (!full2(n, map->mask0, map->load2))
+		break;
+	    rc = fp47m_resize2_sse4(map, 0, 0, 0);
+	}
+	else {
+	    if (!full4(n, map->mask1, map->load4))
+		break;
+	    rc = fp47m_resize4_sse4(map, 0, 0, 0, false);
+	}
+	if (rc < 0)
+	    return rc;
+	ret = 1;
+    }
+    return ret;
+}
+
+// Complete the split of the buckets.
+int fp47m_migrate_sse4(struct fp47map *map)
+{
+    if (map->mig)
+	split(map, map->mig);
+    return 1;
+}
+
+void fp47m_setvf_sse4(struct fp47map *map)
+{
+    bool re = map->logsize1 > map->logsize0;
+    if (map->bsize == 2) {
+	SetVF(map, 2, _sse4);
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find2st1_sse4 : fp47m_find2st4_sse4;
+    }
+    else if (!re) {
+	SetVF(map, 4, _sse4);
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1_sse4 : fp47m_find4st4_sse4;
+    }
+    else if (map->mig) {
+	SetVF(map, 4mg, _sse4);
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1mg_sse4 : fp47m_find4st4mg_sse4;
+    }
+    else {
+	SetVF(map, 4re, _sse4);
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1re_sse4 : fp47m_find4st4re_sse4;
+    }
 }
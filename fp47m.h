@@ -33,6 +33,7 @@
 // The inline functions rely heavily on constant propagation.
 #define inline inline __attribute__((always_inline))
 #define NOINLINE __attribute__((noinline))
+#define FLATTEN __attribute__((flatten))
 
 union bent {
     uint64_t u64;
@@ -57,6 +58,25 @@ static inline uint32_t mod32(uint64_t fp)
     return lo;
 }
 
+// The distance (xor) between the two buckets of a key.  By default,
+// the alternative bucket can be anywhere in the table.  With -DFP47M_WINDOW=k,
+// both buckets stay within an aligned window of 2^k buckets, like in blocked
+// cuckoo filters: e.g. k=2 keeps them within two cache lines, and k=7 within
+// a 4K page.  Narrow windows make the kicks less effective though, and the map
+// has to grow at a lower fill factor.  With k=1, the distance would always
+// be 1, and each pair of buckets would fill up as one, so k starts at 2.
+// The distance is taken from the high bits of the tag: on resize, the low
+// bits go into the index (ResizeI), and with the same bits in the distance
+// too, all the keys in a window would end up with the same alternative.
+#ifdef FP47M_WINDOW
+#if FP47M_WINDOW < 2 || FP47M_WINDOW > 32
+#error "FP47M_WINDOW must be from 2 to 32"
+#endif
+#define XD(tag) (((tag) >> (32 - FP47M_WINDOW)) | 1)
+#else
+#define XD(tag) (tag)
+#endif
+
 // Fingerprint -> indexes + tag.
 // Note that the two buckets are completely symmetrical with regard to xor,
 // i.e. the information about "the first and true" index is not preserved.
@@ -64,7 +84,7 @@ static inline uint32_t mod32(uint64_t fp)
 #define dFP2I					\
     uint32_t i1 = fp >> 32;			\
     uint32_t tag = mod32(fp);			\
-    uint32_t i2 = i1 ^ tag;			\
+    uint32_t i2 = i1 ^ XD(tag);			\
     i1 &= map->mask0;				\
     i2 &= map->mask0
 
@@ -73,66 +93,441 @@ static inline uint32_t mod32(uint64_t fp)
     do {					\
 	i1 = (i2 < i1) ? i2 : i1;		\
 	i1 |= tag << map->logsize0;		\
-	i2 = i1 ^ tag;				\
+	i2 = i1 ^ XD(tag);			\
 	i1 &= map->mask1;			\
 	i2 &= map->mask1;			\
     } while (0)
 
+// ResizeI, given either bucket of an entry.
+static inline uint32_t reI(const struct fp47map *map, uint32_t i, uint32_t tag)
+{
+    uint32_t i1 = i & map->mask0;
+    uint32_t i2 = (i ^ XD(tag)) & map->mask0;
+    i1 = (i2 < i1) ? i2 : i1;
+    i1 |= tag << map->logsize0;
+    return i1 & map->mask1;
+}
+
+// While the buckets are being split (map->mig > 0), the indexes which
+// fall on the unsplit buckets are folded to the lower half.
+#define MigI						\
+    do {						\
+	uint32_t h = map->mask1 >> 1;			\
+	i1 = ((i1 & h) < map->mig) ? i1 & h : i1;	\
+	i2 = ((i2 & h) < map->mig) ? i2 & h : i2;	\
+    } while (0)
+
+// The number of buckets split on each insert.
+#define MIGSTEP 8
+
+// The alternative bucket of an entry in bucket i, while splitting.
+static inline uint32_t migalt(const struct fp47map *map, uint32_t i, uint32_t tag)
+{
+    uint32_t i1 = reI(map, i, tag);
+    uint32_t i2 = (i1 ^ XD(tag)) & map->mask1;
+    MigI;
+    return (i1 == i) ? i2 : i1;
+}
+
+// With incremental resizing, the last stash slot is kept for the entry
+// which is pending while the buckets are split (with narrow windows or
+// FP47M_BRIM, it is usually the stash overflow that triggers the resize).
+static inline bool stashok(const struct fp47map *map)
+{
+    return map->nstash < 3 || !map->incr;
+}
+
+// The counters, see fp47map_stats.
+#define STAT(map, field, n) FP47M_STAT(map, field, n)
+#ifdef FP47M_STATS
+#include <time.h>
+static inline uint64_t statns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+// Evaluate expr, adding the time it takes to the field.
+#define TIMED(map, field, expr) ({		\
+    uint64_t t_ = statns();			\
+    __typeof__(expr) r_ = (expr);		\
+    STAT(map, field, statns() - t_);		\
+    r_;						\
+})
+// Account for the kick loop, which returns the number of kicks, 0 on failure.
+static inline int kicked(struct fp47map *map, int nk)
+{
+    if (nk) {
+	STAT(map, kicks, nk);
+	unsigned k = 8 * (nk - 1) / (map->maxkick + 1);
+	STAT(map, kickhist[k < 7 ? k : 7], 1);
+    }
+    else {
+	STAT(map, kicks, map->maxkick + 1);
+	STAT(map, kickfail, 1);
+    }
+    return nk;
+}
+#else
+#define TIMED(map, field, expr) (expr)
+#define kicked(map, nk) (nk)
+#endif
+
+// Slot j of bucket i, in any layout: the entries are interleaved, except
+// for the 4-entry SIMD buckets, which keep the tags and the positions apart
+// (struct buck4).
+static inline uint32_t *tagp(const struct fp47map *map, uint32_t i, unsigned j)
+{
+    uint32_t *b = (uint32_t *) map->bb + 2 * (size_t) map->bsize * i;
+    return (map->simd && map->bsize == 4) ? b + j : b + 2 * j;
+}
+
+static inline uint32_t *posp(const struct fp47map *map, uint32_t i, unsigned j)
+{
+    uint32_t *b = (uint32_t *) map->bb + 2 * (size_t) map->bsize * i;
+    return (map->simd && map->bsize == 4) ? b + 4 + j : b + 2 * j + 1;
+}
+
 // Approximates x * log2(x) for x = 4..32.
 static inline unsigned logsize2maxkick(unsigned x)
 {
     return 8 + (x - 4) * 4 + (x > 9) * (x - 9) + (x > 15) * (x - 15);
 }
 
-// We limit the fill factor, to keep the insertions fast.
+// We limit the fill factor, to keep the insertions fast.  The limits are
+// in 1/256ths of the slots: by default, 200 (78%) for 2-entry buckets, and
+// 232 (90.6%) for 4-entry buckets (see fp47map_policy).
+#define LOAD2 200
+#define LOAD4 232
+
+// The number of entries which the buckets can hold before the map is resized.
+static inline size_t fillmax(int bsize, size_t mask, unsigned load)
+{
+    return (uint64_t) bsize * mask * load >> 8;
+}
+
 #ifndef FP47M_BRIM
-static inline bool full2(size_t cnt, size_t mask)
+static inline bool full2(size_t cnt, size_t mask, unsigned load)
+{
+    return cnt > fillmax(2, mask, load);
+}
+
+static inline bool full4(size_t cnt, size_t mask, unsigned load)
+{
+    return cnt > fillmax(4, mask, load);
+}
+#else // to ensure that the stash works; sizeof only marks cnt as used
+#define full2(cnt, mask, load) ((void) sizeof(cnt), 0)
+#define full4(cnt, mask, load) ((void) sizeof(cnt), 0)
+#endif
+
+// The kick limit set by the policy, or else the one which grows with the map.
+static inline void setmaxkick(struct fp47map *map)
+{
+    map->maxkick = map->kickmax ? map->kickmax : logsize2maxkick(map->logsize1);
+}
+
+// Near the fill limit, the random walk in the kick loop gets long, touching
+// a new cache line at every step.  Instead, the shortest path to a free slot
+// is found by a breadth-first search from both buckets, over at most BFSMAX
+// buckets, and the entries are moved only once the free slot is found.
+// The buckets are prefetched as they are queued, which is a level ahead
+// of when they are checked.  This is the slow path, and it works with any
+// bucket layout (via tagp and posp).
+#define BFSMAX 128
+
+static inline bool nearfull(size_t cnt, int bsize, size_t mask, unsigned load)
 {
-    return cnt > mask + 9 * mask / 16;
+    return cnt > fillmax(bsize, mask, load - load / 8);
 }
 
-static inline bool full4(size_t cnt, size_t mask)
+struct bfsnode {
+    // The bucket, and the slot in the parent bucket whose entry moves here.
+    uint32_t i;
+    uint8_t j;
+    uint8_t depth;
+    uint16_t parent;
+};
+
+// Returns the number of entries moved, like the kick loop, or 0 if there's
+// no path (i1 and i2 must be full).  The path is at most maxkick entries long.
+// Not inlined, or else the queue would add a 1K stack frame to every insert.
+static NOINLINE __attribute__((unused)) int bfs(struct fp47map *map, uint32_t i1, uint32_t i2,
+	uint32_t tag, uint32_t pos, uint32_t mask)
 {
-    return cnt > 3 * mask + 5 * mask / 8;
+    struct bfsnode q[BFSMAX];
+    unsigned n = 0;
+    q[n++] = (struct bfsnode) { i1, 0, 0, 0 };
+    if (i2 != i1)
+	q[n++] = (struct bfsnode) { i2, 0, 0, 0 };
+    for (unsigned h = 0; h < n; h++) {
+	uint32_t i = q[h].i;
+	for (unsigned e = 0; q[h].depth && e < map->bsize; e++) {
+	    if (*tagp(map, i, e))
+		continue;
+	    // Move the entries along the path, starting from the free slot.
+	    for (unsigned k = h; q[k].depth; k = q[k].parent) {
+		uint32_t pi = q[q[k].parent].i;
+		*posp(map, i, e) = *posp(map, pi, q[k].j);
+		*tagp(map, i, e) = *tagp(map, pi, q[k].j);
+		i = pi, e = q[k].j;
+	    }
+	    *posp(map, i, e) = pos;
+	    *tagp(map, i, e) = tag;
+	    return kicked(map, q[h].depth);
+	}
+	for (unsigned j = 0; q[h].depth < map->maxkick && j < map->bsize && n < BFSMAX; j++) {
+	    uint32_t c = (i ^ XD(*tagp(map, i, j))) & mask;
+	    // The buckets on the path must be distinct.
+	    unsigned k = h;
+	    while (q[k].i != c && q[k].depth)
+		k = q[k].parent;
+	    if (q[k].i == c)
+		continue;
+	    __builtin_prefetch(tagp(map, c, 0));
+	    q[n++] = (struct bfsnode) { c, j, q[h].depth + 1, h };
+	}
+    }
+    return 0;
 }
-#else // to ensure that the stash works
-#define full2(cnt, mask) 0
-#define full4(cnt, mask) 0
+
+// Running out of the stash while the table is less than half full means
+// that the fingerprints are degenerate (too many duplicates), and resizing
+// won't help.  Narrow windows though overflow at a much lower fill factor.
+#ifndef FP47M_WINDOW
+#define broken4(cnt, mask) ((cnt) / 2 <= (mask))
+#else
+#define broken4(cnt, mask) ((cnt) * 16 <= (mask))
 #endif
 
+// Shrink only if the smaller table is going to be at most half full,
+// relative to its fill limit (otherwise it may have to grow right back).
+static inline bool low2(size_t cnt, size_t mask, unsigned load)
+{
+    return 2 * cnt <= fillmax(2, mask, load);
+}
+
+static inline bool low4(size_t cnt, size_t mask, unsigned load)
+{
+    return 2 * cnt <= fillmax(4, mask, load);
+}
+
+// How many keys ahead the batch functions prefetch the buckets.
+#ifndef FP47M_PFD
+#define FP47M_PFD 8
+#endif
+
+// Batch lookup, software-pipelined: prefetch the buckets for fps[i+PFD],
+// then resolve fps[i].  The vfuncs are passed as compile-time constants,
+// so that the per-key calls get inlined (with FLATTEN on the caller).
+static inline void find_batch(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound,
+	void (FP47M_FASTCALL *prefetch)(uint64_t fp, const struct fp47map *map),
+	unsigned (FP47M_FASTCALL *find)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    size_t i = 0;
+    for (; i < n && i < FP47M_PFD; i++)
+	prefetch(fps[i], map);
+    for (i = 0; i + FP47M_PFD < n; i++) {
+	prefetch(fps[i+FP47M_PFD], map);
+	nfound[i] = find(fps[i], map, mpos[i]);
+    }
+    for (; i < n; i++)
+	nfound[i] = find(fps[i], map, mpos[i]);
+}
+
+// Batch insert, same pipelining.  A resize switches the vfuncs, in which case
+// the rest of the batch is passed on to the new map->insert_batch.
+static inline int insert_batch(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n,
+	void (FP47M_FASTCALL *prefetch)(uint64_t fp, const struct fp47map *map),
+	int (FP47M_FASTCALL *insert)(uint64_t fp, struct fp47map *map, uint32_t pos))
+{
+    int rc;
+    size_t i = 0;
+    for (; i < n && i < FP47M_PFD; i++)
+	prefetch(fps[i], map);
+    for (i = 0; i + FP47M_PFD < n; i++) {
+	prefetch(fps[i+FP47M_PFD], map);
+	rc = insert(fps[i], map, pos[i]);
+	if (unlikely(rc != 1))
+	    goto out;
+    }
+    for (; i < n; i++) {
+	rc = insert(fps[i], map, pos[i]);
+	if (unlikely(rc != 1))
+	    goto out;
+    }
+    return 1;
+out:
+    if (rc < 0)
+	return rc;
+    i++;
+    rc = map->insert_batch(map, fps + i, pos + i, n - i);
+    return rc < 0 ? rc : 2;
+}
+
 #pragma GCC visibility push(hidden)
 
-// The initial set of virtual functions.
-unsigned FASTCALL fp47m_find2(uint64_t fp, const struct fp47map *map, uint32_t *mpos);
-int FASTCALL fp47m_insert2(uint64_t fp, struct fp47map *map, uint32_t pos);
-void FASTCALL fp47m_prefetch2(uint64_t fp, const struct fp47map *map);
+// The backends (map->simd).
+enum { FP47M_SIMD_GENERIC, FP47M_SIMD_SSE4, FP47M_SIMD_AVX2, FP47M_SIMD_AVX512 };
+
+// Switch to a backend, installing the vfuncs which match the map's state.
+void fp47m_init(struct fp47map *map, int simd);
+
+// The initial set of virtual functions, for each backend.
+#define DeclVF2(sfx)								\
+unsigned FASTCALL fp47m_find2##sfx(uint64_t fp, const struct fp47map *map, uint32_t *mpos); \
+int FASTCALL fp47m_insert2##sfx(uint64_t fp, struct fp47map *map, uint32_t pos);	\
+void FASTCALL fp47m_prefetch2##sfx(uint64_t fp, const struct fp47map *map);		\
+void FASTCALL fp47m_find_batch2##sfx(const struct fp47map *map, const uint64_t *fps, size_t n, \
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound);			\
+int FASTCALL fp47m_insert_batch2##sfx(struct fp47map *map, const uint64_t *fps,	\
+	const uint32_t *pos, size_t n);							\
+int FASTCALL fp47m_erase2##sfx(uint64_t fp, struct fp47map *map, uint32_t pos);		\
+int FASTCALL fp47m_replace2##sfx(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
 
+// Operations which are not vfuncs, implemented by each backend.
+#define DeclOps(sfx)								\
+void fp47m_setvf##sfx(struct fp47map *map);					\
+int fp47m_shrink##sfx(struct fp47map *map);					\
+int fp47m_drain##sfx(struct fp47map *map);					\
+int fp47m_reserve##sfx(struct fp47map *map, size_t n);				\
+int fp47m_migrate##sfx(struct fp47map *map)
+
+DeclVF2(); DeclOps();
 #if defined(__i386__) || defined(__x86_64__)
-unsigned FASTCALL fp47m_find2_sse4(uint64_t fp, const struct fp47map *map, uint32_t *mpos);
-int FASTCALL fp47m_insert2_sse4(uint64_t fp, struct fp47map *map, uint32_t pos);
-void FASTCALL fp47m_prefetch2_sse4(uint64_t fp, const struct fp47map *map);
+DeclVF2(_sse4); DeclOps(_sse4);
+DeclVF2(_avx2); DeclOps(_avx2);
+DeclVF2(_avx512); DeclOps(_avx512);
 #endif
 
+// Install the set of vfuncs for the bucket state (2, 4, or 4re).
+#define SetVF(map, state, sfx)					\
+    do {							\
+	map->find = fp47m_find##state##sfx;			\
+	map->insert = fp47m_insert##state##sfx;			\
+	map->prefetch = fp47m_prefetch##state##sfx;		\
+	map->find_batch = fp47m_find_batch##state##sfx;		\
+	map->insert_batch = fp47m_insert_batch##state##sfx;	\
+	map->erase = fp47m_erase##state##sfx;			\
+	map->replace = fp47m_replace##state##sfx;		\
+    } while (0)
+
 #pragma GCC visibility pop
 
 // malloc/mmap threshold
 #define MTHRESH 99999
 
-static inline void *allocX2(void **pp, size_t bytes)
+// Tables of at least 2M can be backed by huge pages (map->huge).
+#define HUGESZ (2 << 20)
+enum { FP47M_HUGE_NONE, FP47M_HUGE_THP, FP47M_HUGE_TLB };
+
+#pragma GCC visibility push(hidden)
+// Allocate a table of at least MTHRESH bytes, obeying map->huge.
+void *fp47m_mmap(struct fp47map *map, size_t bytes);
+// Double the mmap'd table, possibly moving it (map->bb is updated).
+void *fp47m_mremapX2(struct fp47map *map, size_t bytes);
+
+// Run func over the buckets [lo,hi), split into parts for map->nthreads.
+// Each thread gets at least PARMIN buckets, smaller ranges are not split.
+#define PARMIN (1 << 14)
+void fp47m_parallel(const struct fp47map *map, size_t lo, size_t hi,
+	void (*func)(void *arg, size_t lo, size_t hi), void *arg);
+#pragma GCC visibility pop
+
+// Whether an mmap'd table is in explicit huge pages.
+static inline bool hugetlb(const struct fp47map *map, size_t bytes)
+{
+    return map->huge == FP47M_HUGE_TLB && bytes >= HUGESZ;
+}
+
+// The custom allocator is asked for cache line-aligned blocks.
+#define AALIGN 64
+
+// Release a block which is not mmap'd.
+static inline void freebb(struct fp47map *map, void *bb, size_t bytes)
+{
+    if (unlikely(map->alloc != NULL))
+	map->alloc->free(map->alloc->ctx, bb, bytes);
+    else
+	free(bb);
+}
+
+static inline void *allocX2(struct fp47map *map, size_t bytes)
 {
     void *p;
-    if (bytes >= MTHRESH) {
-	p = mremap(*pp, bytes, 2 * bytes, MREMAP_MAYMOVE);
-	if (p == MAP_FAILED)
-	    return NULL;
-	*pp = p;
-    }
-    else if (2 * bytes >= MTHRESH) {
-	p = mmap(NULL, 2 * bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-	if (p == MAP_FAILED)
-	    return NULL;
+    const struct fp47map_alloc *a = map->alloc;
+    if (unlikely(a != NULL)) {
+	if (a->grow) {
+	    p = a->grow(a->ctx, map->bb, bytes, 2 * bytes, AALIGN);
+	    if (p)
+		map->bb = p;
+	}
+	else
+	    p = a->alloc(a->ctx, 2 * bytes, AALIGN);
     }
+    else if (bytes >= MTHRESH)
+	p = fp47m_mremapX2(map, bytes);
+    else if (2 * bytes >= MTHRESH)
+	p = fp47m_mmap(map, 2 * bytes);
     else
 	p = aligned_alloc(32, 2 * bytes);
     return p;
 }
+
+// Halving the buckets, the reverse of allocX2, goes in two steps.
+// The data is compacted in place, so if a new block is needed,
+// it must be allocated in advance (NULL otherwise).
+static inline bool allocD2(struct fp47map *map, void **pp, size_t bytes)
+{
+    *pp = NULL;
+    const struct fp47map_alloc *a = map->alloc;
+    if (unlikely(a != NULL)) {
+	*pp = a->alloc(a->ctx, bytes / 2, AALIGN);
+	if (!*pp)
+	    return false;
+    }
+    else if (bytes >= MTHRESH && bytes / 2 < MTHRESH) {
+	*pp = aligned_alloc(32, bytes / 2);
+	if (!*pp)
+	    return false;
+    }
+    // Explicit huge pages cannot be split.
+    else if (hugetlb(map, bytes) && bytes / 2 < HUGESZ) {
+	*pp = fp47m_mmap(map, bytes / 2);
+	if (!*pp)
+	    return false;
+    }
+    return true;
+}
+
+// Then the memory is released.  Small malloc blocks are kept as is.
+static inline void *freeD2(struct fp47map *map, void *bb, size_t bytes, void *p)
+{
+    if (p) {
+	memcpy(p, bb, bytes / 2);
+	if (unlikely(map->alloc != NULL))
+	    map->alloc->free(map->alloc->ctx, bb, bytes);
+	else {
+	    int rc = munmap(bb, bytes);
+	    assert(rc == 0);
+	}
+	return p;
+    }
+    // The upper half is unmapped rather than shrunk with mremap, which fails
+    // on hugetlb mappings before Linux 5.16.  It is page-aligned, and 2M-aligned
+    // with explicit huge pages, since allocD2 copies the blocks under 2M.
+    if (bytes / 2 >= MTHRESH) {
+	int rc = munmap((char *) bb + bytes / 2, bytes / 2);
+	assert(rc == 0);
+    }
+    return bb;
+}
+
+// On shrink, the entries which no longer fit in their buckets are set aside,
+// along with the stash-style index, and then reinserted.
+struct squeezed {
+    uint32_t i1;
+    union bent be;
+};
@@ -18,6 +18,12 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "fp47m.h"
 
 #if UINTPTR_MAX > UINT32_MAX
@@ -32,30 +38,67 @@
 #define MALIGN 16
 #endif
 
-struct fp47map *fp47map_new(int logsize)
+void fp47m_init(struct fp47map *map, int simd)
 {
-    assert(logsize >= 0);
-    if (logsize < 4)
-	logsize = 4;
-    // The ultimate limit imposed by the hashing scheme is 2^32 buckets.
-    // The limit on 32-bit platforms is 2GB, logsize=28 allocates 4GB.
-    if (logsize > ((sizeof(size_t) < 5) ? 27 : 32))
-	return NULL;
+    map->simd = simd;
+    switch (simd) {
+#if defined(__i386__) || defined(__x86_64__)
+    case FP47M_SIMD_SSE4: fp47m_setvf_sse4(map); break;
+    case FP47M_SIMD_AVX2: fp47m_setvf_avx2(map); break;
+    case FP47M_SIMD_AVX512: fp47m_setvf_avx512(map); break;
+#endif
+    default: fp47m_setvf(map); break;
+    }
+}
+
+// The best backend for this CPU.
+static int cpusimd(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+	return FP47M_SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	return FP47M_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt"))
+	return FP47M_SIMD_SSE4;
+#endif
+    return FP47M_SIMD_GENERIC;
+}
+
+// Allocate the counters, if enabled.
+static bool statsnew(struct fp47map *map)
+{
+#ifdef FP47M_STATS
+    map->stats = calloc(1, sizeof *map->stats);
+    return map->stats != NULL;
+#else
+    map->stats = NULL;
+    return true;
+#endif
+}
 
+static struct fp47map *mapnew(int logsize, int bsize, const struct fp47map_alloc *alloc)
+{
     struct fp47map *map = aligned_alloc(16, sizeof *map);
     if (!map)
 	return NULL;
 
     size_t nb = (size_t) 1 << logsize;
-    size_t bytes = 16 * nb;
+    size_t bytes = 8 * bsize * nb;
     void *bb;
-    if (bytes >= MTHRESH) {
+    if (alloc) {
+	bb = alloc->alloc(alloc->ctx, bytes, AALIGN);
+	if (!bb)
+	    return free(map), NULL;
+	memset(bb, 0, bytes);
+    }
+    else if (bytes >= MTHRESH) {
 	bb = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
 	if (bb == MAP_FAILED)
 	    return free(map), NULL;
     }
     else if (MALIGN >= 16) {
-	bb = calloc(nb, 16);
+	bb = calloc(nb, 8 * bsize);
 	if (!bb)
 	    return free(map), NULL;
 	assert((uintptr_t) bb % 16 == 0);
@@ -64,30 +107,89 @@ struct fp47map *fp47map_new(int logsize)
 	bb = aligned_alloc(16, bytes);
 	if (!bb)
 	    return free(map), NULL;
-	memset(bb, 0, 16 * nb);
+	memset(bb, 0, bytes);
     }
 
     map->bb = bb;
+    map->alloc = alloc;
     map->cnt = 0;
-    map->bsize = 2;
+    map->bsize = bsize;
     map->nstash = 0;
     map->logsize0 = map->logsize1 = logsize;
     map->mask0 = map->mask1 = nb - 1;
-    map->maxkick = logsize2maxkick(logsize);
+    map->load2 = LOAD2, map->load4 = LOAD4;
+    map->kickmax = 0;
+    setmaxkick(map);
+    map->frozen = 0;
+    map->huge = FP47M_HUGE_NONE;
+    map->incr = 0;
+    map->mig = 0;
+    map->nthreads = 1;
+    map->pool = NULL;
 
-#if defined(__i386__) || defined(__x86_64__)
-    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt")) {
-	map->find = fp47m_find2_sse4;
-	map->insert = fp47m_insert2_sse4;
-	map->prefetch = fp47m_prefetch2_sse4;
-    }
-    else
+    fp47m_init(map, cpusimd());
+    if (!statsnew(map))
+	return fp47map_free(map), NULL;
+    return map;
+}
+
+// The ultimate limit imposed by the hashing scheme is 2^32 buckets.
+// The limit on 32-bit platforms is 2GB, logsize=28 allocates 4GB.
+#define MAXLOG2 ((sizeof(size_t) < 5) ? 27 : 32)
+#define MAXLOG4 ((sizeof(size_t) < 5) ? 26 : 32)
+
+struct fp47map *fp47map_new_alloc(int logsize, const struct fp47map_alloc *alloc)
+{
+    assert(logsize >= 0);
+    if (logsize < 4)
+	logsize = 4;
+    if (logsize > MAXLOG2)
+	return NULL;
+    return mapnew(logsize, 2, alloc);
+}
+
+struct fp47map *fp47map_new(int logsize)
+{
+    return fp47map_new_alloc(logsize, NULL);
+}
+
+struct fp47map *fp47map_new_capacity(size_t n)
+{
+    int log2 = 4;
+#ifdef FP47M_BRIM
+    // The buckets are never full, so the map is sized as with fp47map_new.
+    while (log2 < MAXLOG2 && ((size_t) 1 << log2) < n)
+	log2++;
+    return mapnew(log2, 2, NULL);
+#else
+    int log4 = 4;
+    while (log2 <= MAXLOG2 && full2(n, ((size_t) 1 << log2) - 1, LOAD2))
+	log2++;
+    while (log4 <= MAXLOG4 && full4(n, ((size_t) 1 << log4) - 1, LOAD4))
+	log4++;
+    // Given the same amount of memory, 4-entry buckets can hold more
+    // entries, but 2-entry buckets are faster.
+    if (log2 <= log4 + 1 && log2 <= MAXLOG2)
+	return mapnew(log2, 2, NULL);
+    if (log4 > MAXLOG4)
+	return NULL;
+    return mapnew(log4, 4, NULL);
 #endif
-    {
-	map->find = fp47m_find2;
-	map->insert = fp47m_insert2;
-	map->prefetch = fp47m_prefetch2;
-    }
+}
+
+struct fp47map *fp47map_new_layout(int logsize, int bsize, int simd)
+{
+    assert(logsize >= 0);
+    assert(bsize == 2 || bsize == 4);
+    if (logsize < 4)
+	logsize = 4;
+    if (logsize > (bsize == 2 ? MAXLOG2 : MAXLOG4))
+	return NULL;
+    if (simd && cpusimd() == FP47M_SIMD_GENERIC)
+	return errno = ENOTSUP, NULL;
+    struct fp47map *map = mapnew(logsize, bsize, NULL);
+    if (map && !simd)
+	fp47m_init(map, FP47M_SIMD_GENERIC);
     return map;
 }
 
@@ -97,15 +199,865 @@ void fp47map_free(struct fp47map *map)
 	return;
     size_t nb = map->mask1 + (size_t) 1;
     size_t bytes = nb * map->bsize * 8;
-    if (bytes >= MTHRESH) {
+    if (map->alloc)
+	map->alloc->free(map->alloc->ctx, map->bb, bytes);
+    else if (bytes >= MTHRESH) {
 	int rc = munmap(map->bb, bytes);
 	assert(rc == 0);
     }
     else
 	free(map->bb);
+    free(map->stats);
     free(map);
 }
 
+// The vfuncs of a frozen map which refuse to modify it.
+static int FASTCALL frozen_insert(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    (void) fp, (void) map, (void) pos;
+    return -3;
+}
+
+static int FASTCALL frozen_insert_batch(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    (void) map, (void) fps, (void) pos, (void) n;
+    return -3;
+}
+
+static int FASTCALL frozen_erase(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    (void) fp, (void) map, (void) pos;
+    return -3;
+}
+
+static int FASTCALL frozen_replace(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    (void) fp, (void) map, (void) pos, (void) newpos;
+    return -3;
+}
+
+static inline bool frozen(const struct fp47map *map)
+{
+    return map->frozen;
+}
+
+void *fp47m_mmap(struct fp47map *map, size_t bytes)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANON;
+    char *p;
+    if (map->huge == FP47M_HUGE_NONE || bytes < HUGESZ) {
+	p = mmap(NULL, bytes, prot, flags, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+    }
+#ifdef MAP_HUGETLB
+    if (map->huge == FP47M_HUGE_TLB) {
+	p = mmap(NULL, bytes, prot, flags | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+	    return p;
+	// The pool is exhausted, fall back to transparent huge pages.
+	map->huge = FP47M_HUGE_THP;
+    }
+#endif
+    // Transparent huge pages need the address aligned to 2M.
+    p = mmap(NULL, bytes + HUGESZ, prot, flags, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    size_t head = -(uintptr_t) p & (HUGESZ - 1);
+    if (head)
+	munmap(p, head);
+    munmap(p + head + bytes, HUGESZ - head);
+    p += head;
+#ifdef MADV_HUGEPAGE
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void *fp47m_mremapX2(struct fp47map *map, size_t bytes)
+{
+    void *bb = map->bb, *p;
+    if (map->huge == FP47M_HUGE_NONE || 2 * bytes < HUGESZ) {
+	p = mremap(bb, bytes, 2 * bytes, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED)
+	    return NULL;
+	return map->bb = p;
+    }
+    // Growing in place keeps the alignment, provided that the block is
+    // aligned already (the blocks under 2M are not).
+    bool tlb = hugetlb(map, bytes);
+    if (map->huge == FP47M_HUGE_THP && ((uintptr_t) bb & (HUGESZ - 1)) == 0) {
+	p = mremap(bb, bytes, 2 * bytes, 0);
+	if (p != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+	    madvise(p, 2 * bytes, MADV_HUGEPAGE);
+#endif
+	    return p;
+	}
+    }
+    // Otherwise, allocate an aligned (or huge) block, and move the pages
+    // there; the pages of different kinds have to be copied.
+    p = fp47m_mmap(map, 2 * bytes);
+    if (!p)
+	return NULL;
+    if (tlb || hugetlb(map, 2 * bytes) ||
+	    mremap(bb, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, p) == MAP_FAILED) {
+	memcpy(p, bb, bytes);
+	int rc = munmap(bb, bytes);
+	assert(rc == 0);
+    }
+#ifdef MADV_HUGEPAGE
+    else
+	madvise(p, 2 * bytes, MADV_HUGEPAGE);
+#endif
+    return map->bb = p;
+}
+
+// Whether transparent huge pages are not disabled system-wide.
+static bool thp_enabled(void)
+{
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!fp)
+	return false;
+    char buf[64];
+    bool ok = fgets(buf, sizeof buf, fp) && !strstr(buf, "[never]");
+    fclose(fp);
+    return ok;
+}
+
+// Whether the huge page pool can back a 2M mapping right now.
+static bool hugetlb_ok(void)
+{
+#ifdef MAP_HUGETLB
+    void *p = mmap(NULL, HUGESZ, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED)
+	return false;
+    int rc = munmap(p, HUGESZ);
+    assert(rc == 0);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int fp47map_hugepages(struct fp47map *map)
+{
+    if (map->alloc)
+	return 0;
+    if (map->huge == FP47M_HUGE_NONE && !frozen(map)) {
+	size_t bytes = (map->mask1 + (size_t) 1) * map->bsize * 8;
+	map->huge = hugetlb_ok() ? FP47M_HUGE_TLB : FP47M_HUGE_THP;
+	// Move the buckets which are already big enough.
+	if (bytes >= HUGESZ) {
+	    void *p = fp47m_mmap(map, bytes);
+	    if (!p)
+		return map->huge = FP47M_HUGE_NONE;
+	    if (hugetlb(map, bytes) ||
+		    mremap(map->bb, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, p) == MAP_FAILED) {
+		memcpy(p, map->bb, bytes);
+		int rc = munmap(map->bb, bytes);
+		assert(rc == 0);
+	    }
+#ifdef MADV_HUGEPAGE
+	    else
+		madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+	    map->bb = p;
+	}
+    }
+    if (map->huge == FP47M_HUGE_THP && !thp_enabled())
+	return 0;
+    return map->huge;
+}
+
+// The file starts with a header, followed by the buckets.  The buckets
+// are stored as is, so the file is only good for the same byte order,
+// bucket layout (generic vs SIMD), and FP47M_WINDOW.  The header is padded
+// to 64K, so that the buckets can be mapped with any page size up to 64K
+// (the mmap offset must be a multiple of the page size).
+#define FILE_MAGIC 0x3270616d37347066 // "fp47map2"
+#define FILE_HSIZE 65536
+
+struct fileh {
+    uint64_t magic;
+    uint64_t cnt;
+    uint8_t bsize, nstash, logsize0, logsize1;
+    uint8_t simd, window, pad[2];
+    unsigned char stash[48];
+    uint32_t mig;
+};
+
+#ifdef FP47M_WINDOW
+#define WINDOW FP47M_WINDOW
+#else
+#define WINDOW 0
+#endif
+
+static int writeall(int fd, const void *buf, size_t size)
+{
+    while (size) {
+	ssize_t n = write(fd, buf, size);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf = (const char *) buf + n, size -= n;
+    }
+    return 0;
+}
+
+// The stash has the bucket indexes first; the generic stash interleaves
+// the tags and the positions (struct stash), the SIMD backends keep them
+// apart.
+static inline unsigned stashtag(bool simd, unsigned j)
+{
+    return simd ? 4 + j : 4 + 2 * j;
+}
+
+static inline unsigned stashpos(bool simd, unsigned j)
+{
+    return simd ? 8 + j : 5 + 2 * j;
+}
+
+// The stash of a file must hold nstash entries within the table.  The slots
+// past nstash may hold stale entries in memory, and are saved as zeros.
+static bool filestash(const struct fileh *h, size_t nb)
+{
+    const uint32_t *st = (const void *) h->stash;
+    for (unsigned j = 0; j < 4; j++) {
+	uint32_t tag = st[stashtag(h->simd, j)];
+	uint32_t pos = st[stashpos(h->simd, j)];
+	if (j < h->nstash ? (tag == 0 || st[j] >= nb) : (tag || pos || st[j]))
+	    return false;
+    }
+    return true;
+}
+
+int fp47map_save(const struct fp47map *map, int fd)
+{
+    union {
+	struct fileh h;
+	char page[4096];
+    } u;
+    memset(&u, 0, sizeof u);
+    u.h.magic = FILE_MAGIC;
+    u.h.cnt = map->cnt;
+    u.h.bsize = map->bsize, u.h.nstash = map->nstash;
+    u.h.logsize0 = map->logsize0, u.h.logsize1 = map->logsize1;
+    // Only the layout matters, SSE4 and up are the same.
+    u.h.simd = map->simd != FP47M_SIMD_GENERIC;
+    u.h.window = WINDOW;
+    const uint32_t *st = (const void *) map->stash;
+    uint32_t *hst = (void *) u.h.stash;
+    for (unsigned j = 0; j < map->nstash; j++) {
+	unsigned t = stashtag(u.h.simd, j), p = stashpos(u.h.simd, j);
+	hst[j] = st[j], hst[t] = st[t], hst[p] = st[p];
+    }
+    // The split in progress is saved as is.
+    u.h.mig = map->mig;
+    size_t bytes = (map->mask1 + (size_t) 1) * map->bsize * 8;
+    if (writeall(fd, &u, sizeof u) < 0)
+	return -1;
+    // The rest of the header is zeros.
+    memset(&u, 0, sizeof u);
+    for (size_t off = sizeof u; off < FILE_HSIZE; off += sizeof u)
+	if (writeall(fd, &u, sizeof u) < 0)
+	    return -1;
+    return writeall(fd, map->bb, bytes);
+}
+
+// The buckets of a loaded map are released with munmap; when the map grows,
+// the new buckets are allocated anew, since a file mapping cannot be extended.
+static void *fmalloc(void *ctx, size_t size, size_t align)
+{
+    (void) ctx, (void) align;
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void ffree(void *ctx, void *p, size_t size)
+{
+    (void) ctx;
+    int rc = munmap(p, size);
+    assert(rc == 0);
+}
+
+static const struct fp47map_alloc falloc = { fmalloc, NULL, ffree, NULL };
+
+struct fp47map *fp47map_open_mmap(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+    struct fileh h;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof h, 0) != sizeof h)
+	goto err;
+    errno = EINVAL;
+    if (h.magic != FILE_MAGIC || h.window != WINDOW)
+	goto err;
+    if ((h.bsize != 2 && h.bsize != 4) || h.nstash > 4)
+	goto err;
+    if (h.logsize0 < 4 || h.logsize1 < h.logsize0 || h.logsize1 > (h.bsize == 2 ? MAXLOG2 : MAXLOG4))
+	goto err;
+    if (h.bsize == 2 && h.logsize1 != h.logsize0)
+	goto err;
+    size_t nb = (size_t) 1 << h.logsize1;
+    size_t bytes = nb * h.bsize * 8;
+    if ((uint64_t) st.st_size != FILE_HSIZE + (uint64_t) bytes || h.cnt > nb * h.bsize)
+	goto err;
+    if (h.mig && (h.logsize1 == h.logsize0 || h.mig > nb / 2))
+	goto err;
+    if (!filestash(&h, nb))
+	goto err;
+    int simd = FP47M_SIMD_GENERIC;
+    if (h.simd) {
+	simd = cpusimd();
+	errno = ENOTSUP;
+	if (simd == FP47M_SIMD_GENERIC)
+	    goto err;
+    }
+    struct fp47map *map = aligned_alloc(16, sizeof *map);
+    if (!map)
+	goto err;
+    // Copy-on-write: the pages are loaded lazily, and shared with other
+    // processes until modified.
+    void *bb = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, FILE_HSIZE);
+    if (bb == MAP_FAILED) {
+	free(map);
+	goto err;
+    }
+    close(fd);
+    memcpy(map->stash, h.stash, sizeof h.stash);
+    map->bb = bb;
+    map->alloc = &falloc;
+    map->cnt = h.cnt;
+    map->bsize = h.bsize;
+    map->nstash = h.nstash;
+    map->logsize0 = h.logsize0;
+    map->logsize1 = h.logsize1;
+    map->mask0 = ((size_t) 1 << h.logsize0) - 1;
+    map->mask1 = nb - 1;
+    map->load2 = LOAD2, map->load4 = LOAD4;
+    map->kickmax = 0;
+    setmaxkick(map);
+    map->frozen = 0;
+    map->huge = FP47M_HUGE_NONE;
+    map->incr = 0;
+    map->mig = h.mig;
+    map->nthreads = 1;
+    map->pool = NULL;
+    fp47m_init(map, simd);
+    if (!statsnew(map))
+	return fp47map_free(map), NULL;
+    return map;
+err:;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return NULL;
+}
+
+int fp47map_policy(struct fp47map *map, const struct fp47map_policy *policy)
+{
+    if (policy->maxload > 100 || policy->maxload2 > 100 || policy->maxkick > 255)
+	return -1;
+    // Percent to 1/256ths, rounded.
+    unsigned load4 = policy->maxload ? (policy->maxload * 256 + 50) / 100 : LOAD4;
+    unsigned load2 = policy->maxload2 ? (policy->maxload2 * 256 + 50) / 100 :
+	(LOAD2 < load4) ? LOAD2 : load4;
+    if (load2 > load4)
+	return -1;
+    map->load2 = load2;
+    map->load4 = load4;
+    map->kickmax = policy->maxkick;
+    setmaxkick(map);
+    return 0;
+}
+
+// Call the backend's implementation of an operation which is not a vfunc.
+#if defined(__i386__) || defined(__x86_64__)
+#define Dispatch(map, func, ...)					\
+    switch (map->simd) {						\
+    case FP47M_SIMD_SSE4: return func##_sse4(__VA_ARGS__);		\
+    case FP47M_SIMD_AVX2: return func##_avx2(__VA_ARGS__);		\
+    case FP47M_SIMD_AVX512: return func##_avx512(__VA_ARGS__);		\
+    default: return func(__VA_ARGS__);					\
+    }
+#else
+#define Dispatch(map, func, ...) return func(__VA_ARGS__)
+#endif
+
+static int migrate(struct fp47map *map)
+{
+    Dispatch(map, fp47m_migrate, map);
+}
+
+void fp47map_incremental(struct fp47map *map, int on)
+{
+    if (!on && map->mig)
+	migrate(map);
+    map->incr = on != 0;
+}
+
+void fp47map_threads(struct fp47map *map, int nthreads, const struct fp47map_pool *pool)
+{
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > FP47MAP_MAXTHREADS)
+	nthreads = FP47MAP_MAXTHREADS;
+    map->nthreads = nthreads;
+    map->pool = pool;
+}
+
+// A range of buckets, split into n parts of the same (even) size.
+struct par {
+    void (*func)(void *arg, size_t lo, size_t hi);
+    void *arg;
+    size_t lo, hi, step;
+};
+
+static void partask(void *arg, unsigned j)
+{
+    const struct par *p = arg;
+    size_t lo = p->lo + j * p->step;
+    if (lo >= p->hi)
+	return;
+    size_t hi = (p->hi - lo > p->step) ? lo + p->step : p->hi;
+    p->func(p->arg, lo, hi);
+}
+
+struct parth {
+    pthread_t t;
+    void (*task)(void *arg, unsigned j);
+    void *arg;
+    unsigned j;
+};
+
+static void *parthread(void *arg)
+{
+    struct parth *th = arg;
+    th->task(th->arg, th->j);
+    return NULL;
+}
+
+// Run task(arg, j) for each j below n, with the pool or with new threads.
+// If a thread cannot be started, its task is run by this thread.
+static void runtasks(const struct fp47map *map, unsigned n,
+	void (*task)(void *arg, unsigned j), void *arg)
+{
+    if (map->pool) {
+	map->pool->run(map->pool->ctx, n, task, arg);
+	return;
+    }
+    struct parth th[FP47MAP_MAXTHREADS];
+    for (unsigned j = 1; j < n; j++) {
+	th[j] = (struct parth) { .task = task, .arg = arg, .j = j };
+	if (pthread_create(&th[j].t, NULL, parthread, &th[j]))
+	    th[j].task = NULL, task(arg, j);
+    }
+    task(arg, 0);
+    for (unsigned j = 1; j < n; j++)
+	if (th[j].task)
+	    pthread_join(th[j].t, NULL);
+}
+
+void fp47m_parallel(const struct fp47map *map, size_t lo, size_t hi,
+	void (*func)(void *arg, size_t lo, size_t hi), void *arg)
+{
+    size_t n = (hi - lo) / PARMIN;
+    if (n > map->nthreads)
+	n = map->nthreads;
+    if (n < 2) {
+	func(arg, lo, hi);
+	return;
+    }
+    size_t step = (hi - lo + n - 1) / n;
+    struct par p = { func, arg, lo, hi, step + (step & 1) };
+    runtasks(map, n, partask, &p);
+}
+
+// The bulk build: the entries are partitioned by the bucket range of i1,
+// with a radix pass, and each thread fills its own range of buckets,
+// kicking the entries only within the range.  The entries which do not
+// fit are inserted afterwards, in the usual way.
+struct kv {
+    uint64_t fp;
+    uint32_t pos;
+};
+
+struct build {
+    struct fp47map *map;
+    const uint64_t *fps;
+    const uint32_t *pos;
+    size_t n;
+    unsigned nt;
+    // The histogram of the partitions for each thread's slice of the input,
+    // then the offsets into kv; then the entries left in each partition.
+    size_t *off;
+    size_t *left;
+    struct kv *kv;
+    size_t start[FP47MAP_MAXTHREADS+1];
+};
+
+// The bucket indexes and the tag, in any state.
+static inline void buildindex(const struct fp47map *map, uint64_t fp,
+	uint32_t *pi1, uint32_t *pi2, uint32_t *ptag)
+{
+    dFP2I;
+    if (map->logsize1 > map->logsize0)
+	ResizeI;
+    *pi1 = i1, *pi2 = i2, *ptag = tag;
+}
+
+// The partition of bucket i, such that partition p gets [lo(p),lo(p+1)).
+static inline unsigned part(const struct build *b, uint32_t i)
+{
+    return (uint64_t) i * b->nt >> b->map->logsize1;
+}
+
+static inline size_t partlo(const struct build *b, unsigned p)
+{
+    size_t nb = b->map->mask1 + (size_t) 1;
+    return ((uint64_t) p * nb + b->nt - 1) / b->nt;
+}
+
+static void count(void *arg, unsigned t)
+{
+    struct build *b = arg;
+    size_t *off = b->off + t * b->nt;
+    for (size_t k = t * b->n / b->nt; k < (t + 1) * b->n / b->nt; k++) {
+	uint32_t i1, i2, tag;
+	buildindex(b->map, b->fps[k], &i1, &i2, &tag);
+	off[part(b, i1)]++;
+    }
+}
+
+static void scatter(void *arg, unsigned t)
+{
+    struct build *b = arg;
+    size_t *off = b->off + t * b->nt;
+    for (size_t k = t * b->n / b->nt; k < (t + 1) * b->n / b->nt; k++) {
+	uint32_t i1, i2, tag;
+	buildindex(b->map, b->fps[k], &i1, &i2, &tag);
+	b->kv[off[part(b, i1)]++] = (struct kv) { b->fps[k], b->pos[k] };
+    }
+}
+
+static inline int freeslot(const struct fp47map *map, uint32_t i)
+{
+    for (unsigned j = 0; j < map->bsize; j++)
+	if (*tagp(map, i, j) == 0)
+	    return j;
+    return -1;
+}
+
+static inline void put(const struct fp47map *map, uint32_t i, unsigned j, uint32_t tag, uint32_t pos)
+{
+    *posp(map, i, j) = pos;
+    *tagp(map, i, j) = tag;
+}
+
+struct step {
+    uint32_t i;
+    unsigned j;
+};
+
+// Find a path from bucket i to a free slot through the buckets [lo,hi),
+// without moving anything.  Returns the number of kicks, 0 if there's
+// no path.
+static unsigned findpath(const struct fp47map *map, uint32_t i, uint32_t seed,
+	struct step *path, size_t lo, size_t hi)
+{
+    for (unsigned k = 0; k <= map->maxkick; k++) {
+	// Pick the entry to kick out pseudo-randomly, to avoid short cycles.
+	seed = seed * 1103515245 + 12345;
+	unsigned j = (seed >> 16) % map->bsize;
+	for (unsigned m = 0; m < k; m++)
+	    if (path[m].i == i && path[m].j == j)
+		return 0;
+	path[k] = (struct step) { i, j };
+	i = (i ^ XD(*tagp(map, i, j))) & map->mask1;
+	if (i - lo >= hi - lo)
+	    return 0;
+	int e = freeslot(map, i);
+	if (e >= 0) {
+	    path[k+1] = (struct step) { i, e };
+	    return k + 1;
+	}
+    }
+    return 0;
+}
+
+// Fill partition p, the entries left over are moved to the front.
+static void fillpart(void *arg, unsigned p)
+{
+    struct build *b = arg;
+    const struct fp47map *map = b->map;
+    size_t lo = partlo(b, p), hi = partlo(b, p + 1);
+    struct kv *kv = b->kv + b->start[p];
+    size_t n = b->start[p+1] - b->start[p], left = 0;
+    struct step path[256+1];
+    for (size_t k = 0; k < n; k++) {
+	uint32_t i1, i2, tag, pos = kv[k].pos;
+	buildindex(map, kv[k].fp, &i1, &i2, &tag);
+	bool in2 = i2 - lo < hi - lo;
+	int j = freeslot(map, i1);
+	if (j >= 0) {
+	    put(map, i1, j, tag, pos);
+	    continue;
+	}
+	if (in2 && (j = freeslot(map, i2)) >= 0) {
+	    put(map, i2, j, tag, pos);
+	    continue;
+	}
+	unsigned m = findpath(map, i1, tag, path, lo, hi);
+	if (m == 0 && in2)
+	    m = findpath(map, i2, ~tag, path, lo, hi);
+	if (m == 0) {
+	    kv[left++] = kv[k];
+	    continue;
+	}
+	// Move the entries along the path, starting from the free slot.
+	for (unsigned q = m; q > 0; q--) {
+	    uint32_t i = path[q-1].i;
+	    unsigned e = path[q-1].j;
+	    put(map, path[q].i, path[q].j, *tagp(map, i, e), *posp(map, i, e));
+	}
+	put(map, path[0].i, path[0].j, tag, pos);
+    }
+    b->left[p] = left;
+}
+
+struct fp47map *fp47map_build(const uint64_t *fps, const uint32_t *pos, size_t n, int nthreads)
+{
+    struct fp47map *map = fp47map_new_capacity(n);
+    if (!map)
+	return NULL;
+    fp47map_threads(map, nthreads, NULL);
+    unsigned nt = map->nthreads;
+    size_t nb = map->mask1 + (size_t) 1;
+    if (nt > nb / PARMIN)
+	nt = nb / PARMIN;
+    if (nt < 2) {
+	if (fp47map_insert_batch(map, fps, pos, n) < 0)
+	    return fp47map_free(map), NULL;
+	return map;
+    }
+    struct build b = { .map = map, .fps = fps, .pos = pos, .n = n, .nt = nt };
+    b.off = calloc(nt * nt + nt, sizeof *b.off);
+    b.kv = malloc(n * sizeof *b.kv);
+    if (!b.off || !b.kv) {
+	free(b.off), free(b.kv);
+	return fp47map_free(map), NULL;
+    }
+    b.left = b.off + nt * nt;
+    runtasks(map, nt, count, &b);
+    // The entries of partition p from slice t go after those from slice t-1.
+    size_t sum = 0;
+    for (unsigned p = 0; p < nt; p++) {
+	b.start[p] = sum;
+	for (unsigned t = 0; t < nt; t++) {
+	    size_t c = b.off[t*nt+p];
+	    b.off[t*nt+p] = sum;
+	    sum += c;
+	}
+    }
+    b.start[nt] = sum;
+    runtasks(map, nt, scatter, &b);
+    runtasks(map, nt, fillpart, &b);
+    map->cnt = n;
+    for (unsigned p = 0; p < nt; p++)
+	map->cnt -= b.left[p];
+    int rc = 1;
+    for (unsigned p = 0; p < nt && rc > 0; p++) {
+	struct kv *kv = b.kv + b.start[p];
+	for (size_t k = 0; k < b.left[p] && rc > 0; k++)
+	    rc = fp47map_insert(map, kv[k].fp, kv[k].pos);
+    }
+    free(b.off), free(b.kv);
+    if (rc < 0)
+	return fp47map_free(map), NULL;
+    return map;
+}
+
+int fp47map_shrink(struct fp47map *map)
+{
+    if (frozen(map))
+	return -3;
+    if (map->mig)
+	migrate(map);
+    Dispatch(map, fp47m_shrink, map);
+}
+
+int fp47map_reserve(struct fp47map *map, size_t n)
+{
+    if (frozen(map))
+	return -3;
+    if (map->mig)
+	migrate(map);
+    Dispatch(map, fp47m_reserve, map, n);
+}
+
+static int drain(struct fp47map *map)
+{
+    Dispatch(map, fp47m_drain, map);
+}
+
+int fp47map_foreach_range(const struct fp47map *map, size_t lo, size_t hi,
+	int (*func)(void *arg, uint32_t i, uint32_t tag, uint32_t pos), void *arg)
+{
+    int rc;
+    size_t nb = map->mask1 + (size_t) 1;
+    hi = (hi < nb) ? hi : nb;
+    // While splitting, the upper halves of the unsplit buckets are not in use.
+    size_t h = nb / 2;
+    for (size_t i = lo; i < hi; i++) {
+	if (map->mig && i - h < map->mig)
+	    continue;
+	for (unsigned j = 0; j < map->bsize; j++) {
+	    uint32_t tag = *tagp(map, i, j);
+	    if (tag && (rc = func(arg, i, tag, *posp(map, i, j))))
+		return rc;
+	}
+    }
+    if (lo > 0)
+	return 0;
+    const uint32_t *st = (const void *) map->stash;
+    for (unsigned j = 0; j < map->nstash; j++) {
+	uint32_t tag = st[stashtag(map->simd, j)];
+	uint32_t pos = st[stashpos(map->simd, j)];
+	if ((rc = func(arg, st[j], tag, pos)))
+	    return rc;
+    }
+    return 0;
+}
+
+int fp47map_foreach(const struct fp47map *map,
+	int (*func)(void *arg, uint32_t i, uint32_t tag, uint32_t pos), void *arg)
+{
+    return fp47map_foreach_range(map, 0, SIZE_MAX, func, arg);
+}
+
+int fp47map_stats(const struct fp47map *map, struct fp47map_stats *st)
+{
+    if (!map->stats)
+	return memset(st, 0, sizeof *st), -1;
+    // The counters are all uint64_t, and are updated with relaxed stores.
+    const uint64_t *src = (const void *) map->stats;
+    uint64_t *dst = (void *) st;
+    for (size_t j = 0; j < sizeof *st / 8; j++)
+	dst[j] = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+    return 0;
+}
+
+struct analyze {
+    const struct fp47map *map;
+    struct fp47map_analysis *an;
+};
+
+static inline unsigned tagcnt(const struct fp47map *map, uint32_t i, uint32_t tag)
+{
+    unsigned n = 0;
+    for (unsigned j = 0; j < map->bsize; j++)
+	n += *tagp(map, i, j) == tag;
+    return n;
+}
+
+static void analyze(void *arg, size_t lo, size_t hi)
+{
+    const struct analyze *a = arg;
+    const struct fp47map *map = a->map;
+    size_t fill[5] = { 0 }, alt = 0, groups[9] = { 0 };
+    size_t h = map->mask1 / 2 + 1;
+    for (size_t i = lo; i < hi; i++) {
+	if (map->mig && i - h < map->mig) {
+	    fill[0]++;
+	    continue;
+	}
+	unsigned n = 0;
+	for (unsigned j = 0; j < map->bsize; j++) {
+	    uint32_t tag = *tagp(map, i, j);
+	    if (!tag)
+		continue;
+	    n++;
+	    // The pair of buckets, i1 being the one under which it is stashed.
+	    uint32_t i1 = reI(map, i, tag);
+	    uint32_t i2 = (i1 ^ XD(tag)) & map->mask1;
+	    if (map->mig)
+		MigI;
+	    alt += i != i1;
+	    // Each group is counted once, with its first entry in the pair.
+	    unsigned k = 0;
+	    while (*tagp(map, i, k) != tag)
+		k++;
+	    if (k < j)
+		continue;
+	    unsigned m = tagcnt(map, i, tag);
+	    uint32_t o = (i == i1) ? i2 : i1;
+	    if (o != i) {
+		unsigned mo = tagcnt(map, o, tag);
+		if (mo && o < i)
+		    continue;
+		m += mo;
+	    }
+	    groups[m]++;
+	}
+	fill[n]++;
+    }
+    struct fp47map_analysis *an = a->an;
+    for (unsigned k = 0; k < 5; k++)
+	__atomic_fetch_add(&an->fill[k], fill[k], __ATOMIC_RELAXED);
+    for (unsigned k = 0; k < 9; k++)
+	__atomic_fetch_add(&an->groups[k], groups[k], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&an->alt, alt, __ATOMIC_RELAXED);
+}
+
+void fp47map_analyze(const struct fp47map *map, struct fp47map_analysis *an)
+{
+    memset(an, 0, sizeof *an);
+    an->nbuckets = map->mask1 + (size_t) 1;
+    an->cnt = map->cnt;
+    an->bsize = map->bsize;
+    an->nstash = map->nstash;
+    an->load = (double) (map->cnt + map->nstash) / (an->nbuckets * map->bsize);
+    const uint32_t *st = (const void *) map->stash;
+    for (unsigned j = 0; j < map->nstash; j++) {
+	an->stash[j].i = st[j];
+	an->stash[j].tag = map->simd ? st[4+j] : st[4+2*j];
+	an->stash[j].pos = map->simd ? st[8+j] : st[5+2*j];
+    }
+    struct analyze a = { map, an };
+    fp47m_parallel(map, 0, an->nbuckets, analyze, &a);
+}
+
+int fp47map_freeze(struct fp47map *map)
+{
+    if (frozen(map))
+	return map->nstash == 0;
+    int rc = 1;
+    if (map->mig)
+	migrate(map);
+    if (map->nstash) {
+	rc = drain(map);
+	if (rc < 0)
+	    return rc;
+    }
+    map->frozen = 1;
+    map->insert = frozen_insert;
+    map->insert_batch = frozen_insert_batch;
+    map->erase = frozen_erase;
+    map->replace = frozen_replace;
+    // The mmap'd buckets can be write-protected.
+    size_t bytes = (map->mask1 + (size_t) 1) * map->bsize * 8;
+    if ((!map->alloc && bytes >= MTHRESH) || map->alloc == &falloc)
+	mprotect(map->bb, bytes, PROT_READ);
+    return rc;
+}
+
 struct stash {
     // Since bucket entries are looked up by index+tag, we also need to
     // remember the index (there are actually two symmetrical indices and
@@ -138,6 +1090,14 @@ static void FASTCALL fp47m_prefetch4re(uint64_t fp, const struct fp47map *map)
     __builtin_prefetch(bb + 4 * i2);
 }
 
+static void FASTCALL fp47m_prefetch4mg(uint64_t fp, const struct fp47map *map)
+{
+    dFP2I; ResizeI; MigI;
+    union bent *bb = map->bb;
+    __builtin_prefetch(bb + 4 * i1);
+    __builtin_prefetch(bb + 4 * i2);
+}
+
 static inline unsigned find(int bsize, union bent *b1, union bent *b2, uint32_t tag, uint32_t *mpos)
 {
     unsigned n = 0;
@@ -159,8 +1119,9 @@ static inline unsigned find(int bsize, union bent *b1, union bent *b2, uint32_t
 	    break;						\
 	if (unlikely(st->i1[j] != i1))				\
 	    break;						\
-	*mpos = st->be[j].pos;					\
+	mpos[n] = st->be[j].pos;				\
 	n += 1;							\
+	STAT(map, sthits, 1);					\
     } while (0)
 
 unsigned FASTCALL fp47m_find2(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
@@ -242,6 +1203,82 @@ static unsigned FASTCALL fp47m_find4st4re(uint64_t fp, const struct fp47map *map
     return n;
 }
 
+static unsigned FASTCALL fp47m_find4mg(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI; MigI;
+    union bent *bb = map->bb;
+    return find(4, bb + 4 * i1, bb + 4 * i2, tag, mpos);
+}
+
+// The stash is checked with i1 as seen by ResizeI.
+static unsigned FASTCALL fp47m_find4st1mg(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    union bent *bb = map->bb;
+    unsigned n = find(4, bb + 4 * i1, bb + 4 * i2, tag, mpos);
+    i1 = si1;
+    FindSt1(0);
+    return n;
+}
+
+static unsigned FASTCALL fp47m_find4st4mg(uint64_t fp, const struct fp47map *map, uint32_t *mpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    union bent *bb = map->bb;
+    unsigned n = find(4, bb + 4 * i1, bb + 4 * i2, tag, mpos);
+    i1 = si1;
+    FindSt1(0); FindSt1(1); FindSt1(2); FindSt1(3);
+    return n;
+}
+
+void FASTCALL FLATTEN fp47m_find_batch2(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2, fp47m_find2);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2, fp47m_find2st1);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch2, fp47m_find2st4);
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4, fp47m_find4);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4, fp47m_find4st1);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4, fp47m_find4st4);
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4re(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re, fp47m_find4re);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re, fp47m_find4st1re);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4re, fp47m_find4st4re);
+}
+
+static void FASTCALL FLATTEN fp47m_find_batch4mg(const struct fp47map *map, const uint64_t *fps, size_t n,
+	uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound)
+{
+    if (likely(map->nstash == 0))
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg, fp47m_find4mg);
+    else if (map->nstash == 1)
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg, fp47m_find4st1mg);
+    else
+	find_batch(map, fps, n, mpos, nfound, fp47m_prefetch4mg, fp47m_find4st4mg);
+}
+
 static inline bool insert(int bsize, union bent *b1, union bent *b2, union bent kbe)
 {
     if (bsize > 0 && b1[0].tag == 0) return b1[0] = kbe, true;
@@ -255,11 +1292,14 @@ static inline bool insert(int bsize, union bent *b1, union bent *b2, union bent
     return false;
 }
 
-static inline bool kickloop(int bsize, union bent *bb, union bent *b1,
+// Returns the number of kicks, or 0 if ran out of tries.
+static inline int kickloop(int bsize, union bent *bb, union bent *b1,
 	uint32_t i1, union bent be, uint32_t *oi1, union bent *obe,
 	uint32_t mask, int maxkick)
 {
+    int nk = 0;
     do {
+	nk++;
 	// Put at the top, kick out from the bottom.
 	// Using *obe as a temporary register.
 	*obe = b1[0];
@@ -269,19 +1309,44 @@ static inline bool kickloop(int bsize, union bent *bb, union bent *b1,
 	b1[bsize-1] = be;
 	// Ponder over the entry that's been kicked out.
 	// Find out the alternative bucket.
-	i1 ^= obe->tag;
+	i1 ^= XD(obe->tag);
 	i1 &= mask;
 	b1 = bb + i1 * bsize;
 	// Insert to the alternative bucket.
-	if (bsize > 0 && b1[0].tag == 0) return b1[0] = *obe, true;
-	if (bsize > 1 && b1[1].tag == 0) return b1[1] = *obe, true;
-	if (bsize > 2 && b1[2].tag == 0) return b1[2] = *obe, true;
-	if (bsize > 3 && b1[3].tag == 0) return b1[3] = *obe, true;
+	if (bsize > 0 && b1[0].tag == 0) return b1[0] = *obe, nk;
+	if (bsize > 1 && b1[1].tag == 0) return b1[1] = *obe, nk;
+	if (bsize > 2 && b1[2].tag == 0) return b1[2] = *obe, nk;
+	if (bsize > 3 && b1[3].tag == 0) return b1[3] = *obe, nk;
 	be = *obe;
-    } while (--maxkick >= 0);
+    } while (nk <= maxkick);
     // Ran out of tries? obe already set.
     *oi1 = i1;
-    return false;
+    return 0;
+}
+
+// The kick loop while splitting the buckets, for 4-entry buckets.
+static inline int kickloopmg(const struct fp47map *map, union bent *bb, union bent *b1,
+	uint32_t i1, union bent be, uint32_t *oi1, union bent *obe)
+{
+    int maxkick = map->maxkick;
+    int nk = 0;
+    do {
+	nk++;
+	*obe = b1[0];
+	b1[0] = b1[1];
+	b1[1] = b1[2];
+	b1[2] = b1[3];
+	b1[3] = be;
+	i1 = migalt(map, i1, obe->tag);
+	b1 = bb + 4 * i1;
+	if (b1[0].tag == 0) return b1[0] = *obe, nk;
+	if (b1[1].tag == 0) return b1[1] = *obe, nk;
+	if (b1[2].tag == 0) return b1[2] = *obe, nk;
+	if (b1[3].tag == 0) return b1[3] = *obe, nk;
+	be = *obe;
+    } while (nk <= maxkick);
+    *oi1 = i1;
+    return 0;
 }
 
 static inline bool putstash(struct fp47map *map, uint32_t i1, union bent kbe,
@@ -296,6 +1361,7 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, union bent kbe,
 	st->be[1] = st->be[2] = st->be[3] = BE0;
 	map->find = find_st1;
 	map->nstash = 1, map->cnt--;
+	STAT(map, stashed, 1);
 	return true;
     }
     if (likely(map->nstash < 4)) {
@@ -303,6 +1369,7 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, union bent kbe,
 	st->be[map->nstash] = kbe;
 	map->find = find_st4;
 	map->nstash++, map->cnt--;
+	STAT(map, stashed, 1);
 	return true;
     }
     return false;
@@ -310,9 +1377,10 @@ static inline bool putstash(struct fp47map *map, uint32_t i1, union bent kbe,
 
 #define A16(p) __builtin_assume_aligned(p, 16)
 
-static inline void reinterp24(union bent *bb, size_t nb, union bent *bb4)
+// Convert the buckets [lo,hi), top down (which works in place).
+static inline void reinterp24(union bent *bb, size_t lo, size_t hi, union bent *bb4)
 {
-    for (size_t i = nb - 2; i; i -= 2) {
+    for (size_t i = hi - 2; i > lo; i -= 2) {
 	union bent *b2 = bb  + 2 * i;
 	union bent *b4 = bb4 + 4 * i;
 	memcpy(A16(b4 + 0), A16(b2 + 0), 16);
@@ -320,20 +1388,24 @@ static inline void reinterp24(union bent *bb, size_t nb, union bent *bb4)
 	memset(A16(b4 + 2), 0, 16);
 	memset(A16(b4 + 6), 0, 16);
     }
+    // The first pair may overlap, when lo = 0.
+    union bent *b2 = bb  + 2 * lo;
+    union bent *b4 = bb4 + 4 * lo;
     uint64_t be0[2], be1[2];
-    memcpy(&be0, A16(bb + 0), 16);
-    memcpy(&be1, A16(bb + 2), 16);
-    memcpy(A16(bb4 + 0), &be0, 16);
-    memcpy(A16(bb4 + 4), &be1, 16);
-    memset(A16(bb4 + 2), 0, 16);
-    memset(A16(bb4 + 6), 0, 16);
+    memcpy(&be0, A16(b2 + 0), 16);
+    memcpy(&be1, A16(b2 + 2), 16);
+    memcpy(A16(b4 + 0), &be0, 16);
+    memcpy(A16(b4 + 4), &be1, 16);
+    memset(A16(b4 + 2), 0, 16);
+    memset(A16(b4 + 6), 0, 16);
 }
 
+// Split the buckets [lo,hi) of nb into bb4 (which can be the same as bb).
 static inline void reinterp44(union bent *bb, size_t nb, union bent *bb4,
-	uint32_t mask0, uint32_t mask1, int logsize0)
+	size_t lo, size_t hi, uint32_t mask0, uint32_t mask1, int logsize0)
 {
     union bent *bb8 = bb4 + 4 * nb;
-    for (size_t i = 0; i < nb; i++) {
+    for (size_t i = lo; i < hi; i++) {
 	union bent b[4];
 	memcpy(b, A16(bb + 4 * i), 32);
 	memset(A16(bb4 + 4 * i), 0, 32);
@@ -342,11 +1414,11 @@ static inline void reinterp44(union bent *bb, size_t nb, union bent *bb4,
 	for (unsigned j = 0; j < 4; j++) {
 	    uint32_t tag = b[j].tag;
 	    uint32_t i1 = i;
-	    uint32_t i2 = i ^ tag;
+	    uint32_t i2 = i ^ XD(tag);
 	    i1 &= mask0, i2 &= mask0;
 	    i1 = (i1 < i2) ? i1 : i2;
 	    i1 |= tag << logsize0;
-	    i2 = i1 ^ tag;
+	    i2 = i1 ^ XD(tag);
 	    i1 &= mask1, i2 &= mask1;
 	    union bent *b1 = bb4 + 4 * i;
 	    unsigned j1 = j4;
@@ -360,15 +1432,71 @@ static inline void reinterp44(union bent *bb, size_t nb, union bent *bb4,
     }
 }
 
+// The conversions are run in parallel on big maps.
+struct re24arg {
+    union bent *bb, *bb4;
+};
+
+static void re24(void *arg, size_t lo, size_t hi)
+{
+    const struct re24arg *a = arg;
+    reinterp24(a->bb, lo, hi, a->bb4);
+}
+
+// In place, the upper half of the buckets is converted first (into the new
+// memory), then the upper half of the rest (into the vacated space), etc.
+static void reinterp24p(const struct fp47map *map, union bent *bb, size_t nb, union bent *bb4)
+{
+    struct re24arg a = { bb, bb4 };
+    size_t hi = nb;
+    if (bb == bb4)
+	for (; hi > PARMIN; hi /= 2)
+	    fp47m_parallel(map, hi / 2, hi, re24, &a);
+    fp47m_parallel(map, 0, hi, re24, &a);
+}
+
+struct re44arg {
+    union bent *bb, *bb4;
+    size_t nb;
+    uint32_t mask0, mask1;
+    int logsize0;
+};
+
+static void re44(void *arg, size_t lo, size_t hi)
+{
+    const struct re44arg *a = arg;
+    reinterp44(a->bb, a->nb, a->bb4, lo, hi, a->mask0, a->mask1, a->logsize0);
+}
+
+static void reinterp44p(const struct fp47map *map, union bent *bb, size_t nb, union bent *bb4,
+	size_t lo, size_t hi)
+{
+    struct re44arg a = { bb, bb4, nb, map->mask0, map->mask1, map->logsize0 };
+    fp47m_parallel(map, lo, hi, re44, &a);
+}
+
 static int FASTCALL fp47m_insert4(uint64_t fp, struct fp47map *map, uint32_t pos);
 static int FASTCALL fp47m_insert4re(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_insert_batch4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_insert_batch4re(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_erase4(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_erase4re(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_replace4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
+static int FASTCALL fp47m_replace4re(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
+static int FASTCALL fp47m_insert4mg(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_insert_batch4mg(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n);
+static int FASTCALL fp47m_erase4mg(uint64_t fp, struct fp47map *map, uint32_t pos);
+static int FASTCALL fp47m_replace4mg(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
 
 struct re5 {
     uint32_t i1[5];
     union bent be[5];
 };
 
-// Reinsert the stashed entries and the pending entry.
+// Reinsert the stashed entries and the pending entry (if kbe.tag != 0).
 static inline bool restash(struct fp47map *map, uint32_t i1, union bent kbe, bool re)
 {
     struct re5 re5, ore;
@@ -380,29 +1508,27 @@ static inline bool restash(struct fp47map *map, uint32_t i1, union bent kbe, boo
     memset(&ore.i1[1], 0, 16);
     memset(&ore.be[1], 0, 32);
     union bent *bb = map->bb;
-    unsigned oj = 0;
-    for (unsigned j = 0; j <= n; j++) {
+    unsigned oj = 0, nj = n + (kbe.tag != 0);
+    for (unsigned j = 0; j < nj; j++) {
 	i1 = re5.i1[j], kbe = re5.be[j];
 	uint32_t i2;
 	if (re) {
 	    i1 |= kbe.tag << map->logsize0;
-	    i2 = (i1 ^ kbe.tag) & map->mask1;
+	    i2 = (i1 ^ XD(kbe.tag)) & map->mask1;
 	    i1 &= map->mask1;
 	}
 	else
-	    i2 = (i1 ^ kbe.tag) & map->mask0;
+	    i2 = (i1 ^ XD(kbe.tag)) & map->mask0;
 	union bent *b1 = bb + 4 * i1;
 	if (insert(4, b1, bb + 4 * i2, kbe))
 	    continue;
 	unsigned mask = re ? map->mask1 : map->mask0;
-	if (kickloop(4, bb, b1, i1, kbe, &i1, &kbe, mask, map->maxkick))
+	if (kicked(map, kickloop(4, bb, b1, i1, kbe, &i1, &kbe, mask, map->maxkick)))
 	    continue;
-	if (re) {
-	    i2 = (i1 ^ kbe.tag) & map->mask1;
-	    i1 = ((i1 & map->mask0) < (i2 & map->mask0)) ? i1 : i2;
-	}
+	if (re)
+	    i1 = reI(map, i1, kbe.tag);
 	else {
-	    i2 = (i1 ^ kbe.tag) & map->mask0;
+	    i2 = (i1 ^ XD(kbe.tag)) & map->mask0;
 	    i1 = (i1 < i2) ? i1 : i2;
 	}
 	ore.i1[oj] = i1, ore.be[oj++] = kbe;
@@ -423,48 +1549,69 @@ static inline bool restash(struct fp47map *map, uint32_t i1, union bent kbe, boo
     return true;
 }
 
-static NOINLINE int fp47m_resize2(struct fp47map *map, uint32_t i1, union bent kbe)
+static inline int resize2(struct fp47map *map, uint32_t i1, union bent kbe)
 {
     if (sizeof(size_t) < 5 && map->logsize0 == 27)
 	return -2;
     size_t nb = map->mask0 + (size_t) 1;
-    void *bb = allocX2(&map->bb, nb * 16);
+    void *bb = allocX2(map, nb * 16);
     if (!bb)
 	return -2;
-    reinterp24(map->bb, nb, bb);
+    reinterp24p(map, map->bb, nb, bb);
     if (map->bb != bb)
-	free(map->bb), map->bb = bb;
+	freebb(map, map->bb, nb * 16), map->bb = bb;
     map->bsize = 4;
-    map->find = fp47m_find4;
-    map->insert = fp47m_insert4;
-    map->prefetch = fp47m_prefetch4;
-    if (restash(map, i1, kbe, false))
+    SetVF(map, 4, );
+    if (TIMED(map, restash_ns, restash(map, i1, kbe, false)))
 	return 2;
     return -1;
 }
 
-static NOINLINE int fp47m_resize4(struct fp47map *map, uint32_t i1, union bent kbe)
+// With incr, the buckets which have grown in place are split later, on insert,
+// and the pending entry is stashed in the meantime.
+static inline int resize4(struct fp47map *map, uint32_t i1, union bent kbe, bool incr)
 {
     if (map->logsize1 == ((sizeof(size_t) < 5) ? 26 : 32))
 	return -2;
     size_t nb = map->mask1 + (size_t) 1;
-    void *bb = allocX2(&map->bb, nb * 32);
+    void *bb = allocX2(map, nb * 32);
     if (!bb)
 	return -2;
     map->mask1 = map->mask1 << 1 | 1;
     map->logsize1++;
-    map->maxkick = logsize2maxkick(map->logsize1);
-    reinterp44(map->bb, nb, bb, map->mask0, map->mask1, map->logsize0);
+    setmaxkick(map);
+    if (incr && map->bb == bb && kbe.tag && map->nstash < 4) {
+	struct stash *st = (void *) &map->stash;
+	for (unsigned j = 0; j < map->nstash; j++)
+	    st->i1[j] = reI(map, st->i1[j], st->be[j].tag);
+	map->mig = nb;
+	SetVF(map, 4mg, );
+	putstash(map, reI(map, i1, kbe.tag), kbe, fp47m_find4st1mg, fp47m_find4st4mg);
+	return 2;
+    }
+    reinterp44p(map, map->bb, nb, bb, 0, nb);
     if (map->bb != bb)
-	free(map->bb), map->bb = bb;
-    map->find = fp47m_find4re;
-    map->insert = fp47m_insert4re;
-    map->prefetch = fp47m_prefetch4re;
-    if (restash(map, i1, kbe, true))
+	freebb(map, map->bb, nb * 32), map->bb = bb;
+    SetVF(map, 4re, );
+    if (TIMED(map, restash_ns, restash(map, i1, kbe, true)))
 	return 2;
     return -1;
 }
 
+static NOINLINE int fp47m_resize2(struct fp47map *map, uint32_t i1, union bent kbe)
+{
+    int rc = TIMED(map, resize_ns, resize2(map, i1, kbe));
+    STAT(map, resizes, rc > 0);
+    return rc;
+}
+
+static NOINLINE int fp47m_resize4(struct fp47map *map, uint32_t i1, union bent kbe, bool incr)
+{
+    int rc = TIMED(map, resize_ns, resize4(map, i1, kbe, incr));
+    STAT(map, resizes, rc > 0);
+    return rc;
+}
+
 int FASTCALL fp47m_insert2(uint64_t fp, struct fp47map *map, uint32_t pos)
 {
     dFP2I;
@@ -474,10 +1621,12 @@ int FASTCALL fp47m_insert2(uint64_t fp, struct fp47map *map, uint32_t pos)
     map->cnt++;
     if (insert(2, b1, bb + 2 * i2, kbe))
 	return 1;
-    if (likely(!full2(map->cnt, map->mask0))) {
-	if (kickloop(2, bb, b1, i1, kbe, &i1, &kbe, map->mask0, map->maxkick))
+    if (likely(!full2(map->cnt, map->mask0, map->load2))) {
+	if (nearfull(map->cnt, 2, map->mask0, map->load2) && bfs(map, i1, i2, tag, pos, map->mask0))
 	    return 1;
-	i2 = (i1 ^ kbe.tag) & map->mask0;
+	if (kicked(map, kickloop(2, bb, b1, i1, kbe, &i1, &kbe, map->mask0, map->maxkick)))
+	    return 1;
+	i2 = (i1 ^ XD(kbe.tag)) & map->mask0;
 	i1 = (i1 < i2) ? i1 : i2;
 	if (putstash(map, i1, kbe, fp47m_find2st1, fp47m_find2st4))
 	    return 1;
@@ -496,19 +1645,21 @@ static int FASTCALL fp47m_insert4(uint64_t fp, struct fp47map *map, uint32_t pos
     map->cnt++;
     if (insert(4, b1, bb + 4 * i2, kbe))
 	return 1;
-    if (likely(!full4(map->cnt, map->mask0))) {
-	if (kickloop(4, bb, b1, i1, kbe, &i1, &kbe, map->mask0, map->maxkick))
+    if (likely(!full4(map->cnt, map->mask0, map->load4))) {
+	if (nearfull(map->cnt, 4, map->mask0, map->load4) && bfs(map, i1, i2, tag, pos, map->mask0))
+	    return 1;
+	if (kicked(map, kickloop(4, bb, b1, i1, kbe, &i1, &kbe, map->mask0, map->maxkick)))
 	    return 1;
-	i2 = (i1 ^ kbe.tag) & map->mask0;
+	i2 = (i1 ^ XD(kbe.tag)) & map->mask0;
 	i1 = (i1 < i2) ? i1 : i2;
-	if (putstash(map, i1, kbe, fp47m_find4st1, fp47m_find4st4))
+	if (stashok(map) && putstash(map, i1, kbe, fp47m_find4st1, fp47m_find4st4))
 	    return 1;
-	if (map->cnt / 2 <= map->mask0)
+	if (broken4(map->cnt, map->mask0))
 	    return -1;
     }
     else
 	i1 = (i1 < i2) ? i1 : i2;
-    return fp47m_resize4(map, i1, kbe);
+    return fp47m_resize4(map, i1, kbe, map->incr);
 }
 
 static int FASTCALL fp47m_insert4re(uint64_t fp, struct fp47map *map, uint32_t pos)
@@ -520,15 +1671,493 @@ static int FASTCALL fp47m_insert4re(uint64_t fp, struct fp47map *map, uint32_t p
     map->cnt++;
     if (insert(4, b1, bb + 4 * i2, kbe))
 	return 1;
-    if (likely(!full4(map->cnt, map->mask1))) {
-	if (kickloop(4, bb, b1, i1, kbe, &i1, &kbe, map->mask1, map->maxkick))
+    if (likely(!full4(map->cnt, map->mask1, map->load4))) {
+	if (nearfull(map->cnt, 4, map->mask1, map->load4) && bfs(map, i1, i2, tag, pos, map->mask1))
 	    return 1;
-	i2 = (i1 ^ kbe.tag) & map->mask1;
-	i1 = ((i1 & map->mask0) < (i2 & map->mask0)) ? i1 : i2;
-	if (putstash(map, i1, kbe, fp47m_find4st1re, fp47m_find4st4re))
+	if (kicked(map, kickloop(4, bb, b1, i1, kbe, &i1, &kbe, map->mask1, map->maxkick)))
 	    return 1;
-	if (map->cnt / 2 <= map->mask1)
+	i1 = reI(map, i1, kbe.tag);
+	if (stashok(map) && putstash(map, i1, kbe, fp47m_find4st1re, fp47m_find4st4re))
+	    return 1;
+	if (broken4(map->cnt, map->mask1))
 	    return -1;
     }
-    return fp47m_resize4(map, i1, kbe);
+    return fp47m_resize4(map, i1, kbe, map->incr);
+}
+
+
+int FASTCALL FLATTEN fp47m_insert_batch2(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch2, fp47m_insert2);
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4, fp47m_insert4);
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4re(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4re, fp47m_insert4re);
+}
+
+// Locate the entry with the given tag and position.
+static inline union bent *findbe(int bsize, union bent *b1, union bent *b2, union bent kbe)
+{
+    for (int j = 0; j < bsize; j++) {
+	if (b1[j].u64 == kbe.u64) return &b1[j];
+	if (b2[j].u64 == kbe.u64) return &b2[j];
+    }
+    return NULL;
+}
+
+// Remove the j-th stashed entry, shifting down the rest of the stash
+// (the st1 variant only checks the first slot).
+static inline void delstash(struct fp47map *map, unsigned j,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    struct stash *st = (void *) &map->stash;
+    unsigned n = --map->nstash;
+    for (; j < n; j++)
+	st->i1[j] = st->i1[j+1], st->be[j] = st->be[j+1];
+    st->i1[n] = 0, st->be[n] = BE0;
+    if (n == 0)
+	map->find = find_st0;
+    else if (n == 1)
+	map->find = find_st1;
+}
+
+// A slot has been freed, try to move the stashed entries back to the buckets.
+static inline void unstash(int bsize, struct fp47map *map, bool re,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    struct stash *st = (void *) &map->stash;
+    union bent *bb = map->bb;
+    for (unsigned j = 0; j < map->nstash; ) {
+	uint32_t i1 = st->i1[j], i2;
+	union bent kbe = st->be[j];
+	if (re) {
+	    i1 |= kbe.tag << map->logsize0;
+	    i2 = (i1 ^ XD(kbe.tag)) & map->mask1;
+	    i1 &= map->mask1;
+	}
+	else
+	    i2 = (i1 ^ XD(kbe.tag)) & map->mask0;
+	if (insert(bsize, bb + bsize * i1, bb + bsize * i2, kbe))
+	    delstash(map, j, find_st0, find_st1), map->cnt++;
+	else
+	    j++;
+    }
+}
+
+// The stash index si1 is i1 as seen by the FindSt1 macro.
+static inline int erase(int bsize, struct fp47map *map, uint32_t i1, uint32_t i2,
+	uint32_t si1, union bent kbe, bool re,
+	unsigned (FASTCALL *find_st0)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    union bent *bb = map->bb;
+    union bent *be = findbe(bsize, bb + bsize * i1, bb + bsize * i2, kbe);
+    if (likely(be)) {
+	*be = BE0;
+	map->cnt--;
+	if (unlikely(map->nstash))
+	    unstash(bsize, map, re, find_st0, find_st1);
+	return 1;
+    }
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->be[j].u64 == kbe.u64 && st->i1[j] == si1)
+	    return delstash(map, j, find_st0, find_st1), 1;
+    return 0;
+}
+
+static inline int replace(int bsize, struct fp47map *map, uint32_t i1, uint32_t i2,
+	uint32_t si1, union bent kbe, uint32_t newpos)
+{
+    union bent *bb = map->bb;
+    union bent *be = findbe(bsize, bb + bsize * i1, bb + bsize * i2, kbe);
+    if (likely(be))
+	return be->pos = newpos, 1;
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->be[j].u64 == kbe.u64 && st->i1[j] == si1)
+	    return st->be[j].pos = newpos, 1;
+    return 0;
+}
+
+int FASTCALL fp47m_erase2(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I;
+    union bent kbe = { .tag = tag, .pos = pos };
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return erase(2, map, i1, i2, si1, kbe, false, fp47m_find2, fp47m_find2st1);
+}
+
+static int FASTCALL fp47m_erase4(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I;
+    union bent kbe = { .tag = tag, .pos = pos };
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return erase(4, map, i1, i2, si1, kbe, false, fp47m_find4, fp47m_find4st1);
+}
+
+static int FASTCALL fp47m_erase4re(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI;
+    union bent kbe = { .tag = tag, .pos = pos };
+    return erase(4, map, i1, i2, i1, kbe, true, fp47m_find4re, fp47m_find4st1re);
+}
+
+int FASTCALL fp47m_replace2(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I;
+    union bent kbe = { .tag = tag, .pos = pos };
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return replace(2, map, i1, i2, si1, kbe, newpos);
+}
+
+static int FASTCALL fp47m_replace4(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I;
+    union bent kbe = { .tag = tag, .pos = pos };
+    uint32_t si1 = (i1 < i2) ? i1 : i2;
+    return replace(4, map, i1, i2, si1, kbe, newpos);
+}
+
+static int FASTCALL fp47m_replace4re(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I; ResizeI;
+    union bent kbe = { .tag = tag, .pos = pos };
+    return replace(4, map, i1, i2, i1, kbe, newpos);
+}
+
+// Put back an entry squeezed out on shrink.  In the worst case,
+// when the stash is full, the map gets resized again.
+static inline int reput(int bsize, struct fp47map *map, uint32_t i1, union bent kbe, bool re,
+	unsigned (FASTCALL *find_st1)(uint64_t fp, const struct fp47map *map, uint32_t *mpos),
+	unsigned (FASTCALL *find_st4)(uint64_t fp, const struct fp47map *map, uint32_t *mpos))
+{
+    uint32_t i2;
+    uint32_t mask = re ? map->mask1 : map->mask0;
+    if (re)
+	i1 |= kbe.tag << map->logsize0;
+    i2 = (i1 ^ XD(kbe.tag)) & mask;
+    i1 &= mask;
+    union bent *bb = map->bb;
+    union bent *b1 = bb + bsize * i1;
+    map->cnt++;
+    if (insert(bsize, b1, bb + bsize * i2, kbe))
+	return 1;
+    if (kicked(map, kickloop(bsize, bb, b1, i1, kbe, &i1, &kbe, mask, map->maxkick)))
+	return 1;
+    i2 = (i1 ^ XD(kbe.tag)) & mask;
+    i1 = re ? reI(map, i1, kbe.tag) : (i1 < i2) ? i1 : i2;
+    if (putstash(map, i1, kbe, find_st1, find_st4))
+	return 1;
+    if (bsize == 2)
+	return fp47m_resize2(map, i1, kbe);
+    return fp47m_resize4(map, i1, kbe, false);
+}
+
+static int reputs(struct fp47map *map, struct squeezed *sq, size_t n)
+{
+    int ret = 1;
+    for (size_t j = 0; j < n; j++) {
+	int rc;
+	if (map->bsize == 2)
+	    rc = reput(2, map, sq[j].i1, sq[j].be, false, fp47m_find2st1, fp47m_find2st4);
+	else if (map->logsize1 == map->logsize0)
+	    rc = reput(4, map, sq[j].i1, sq[j].be, false, fp47m_find4st1, fp47m_find4st4);
+	else
+	    rc = reput(4, map, sq[j].i1, sq[j].be, true, fp47m_find4st1re, fp47m_find4st4re);
+	if (rc < 0)
+	    return rc;
+	if (rc > ret)
+	    ret = rc;
+    }
+    return ret;
+}
+
+// Split the next n buckets.  Once done, switch to the 4re state, and try
+// to move the stashed entries to the buckets.  Returns true on the switch.
+static inline bool split(struct fp47map *map, size_t n)
+{
+    size_t nb = (map->mask1 >> 1) + (size_t) 1;
+    n = (n < map->mig) ? n : map->mig;
+    reinterp44p(map, map->bb, nb, map->bb, map->mig - n, map->mig);
+    map->mig -= n;
+    if (likely(map->mig))
+	return false;
+    SetVF(map, 4re, );
+    TIMED(map, restash_ns, restash(map, 0, BE0, true));
+    return true;
+}
+
+static int FASTCALL fp47m_insert4mg(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI; MigI;
+    union bent *bb = map->bb;
+    union bent *b1 = bb + 4 * i1;
+    union bent kbe = { .tag = tag, .pos = pos };
+    map->cnt++;
+    if (insert(4, b1, bb + 4 * i2, kbe))
+	return split(map, MIGSTEP) ? 2 : 1;
+    if (likely(!full4(map->cnt, map->mask1, map->load4))) {
+	if (kicked(map, kickloopmg(map, bb, b1, i1, kbe, &i1, &kbe)))
+	    return split(map, MIGSTEP) ? 2 : 1;
+	if (putstash(map, reI(map, i1, kbe.tag), kbe, fp47m_find4st1mg, fp47m_find4st4mg))
+	    return split(map, MIGSTEP) ? 2 : 1;
+    }
+    // Complete the split, and then the pending entry goes the usual way.
+    map->cnt--;
+    split(map, map->mig);
+    int rc = reput(4, map, reI(map, i1, kbe.tag), kbe, true, fp47m_find4st1re, fp47m_find4st4re);
+    return rc < 0 ? rc : 2;
+}
+
+static int FASTCALL FLATTEN fp47m_insert_batch4mg(struct fp47map *map, const uint64_t *fps,
+	const uint32_t *pos, size_t n)
+{
+    return insert_batch(map, fps, pos, n, fp47m_prefetch4mg, fp47m_insert4mg);
+}
+
+// Unlike erase(), the stashed entries are not moved back to the buckets
+// until the split is complete.
+static int FASTCALL fp47m_erase4mg(uint64_t fp, struct fp47map *map, uint32_t pos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    union bent kbe = { .tag = tag, .pos = pos };
+    union bent *bb = map->bb;
+    union bent *be = findbe(4, bb + 4 * i1, bb + 4 * i2, kbe);
+    if (likely(be)) {
+	*be = BE0;
+	map->cnt--;
+	return 1;
+    }
+    struct stash *st = (void *) &map->stash;
+    for (unsigned j = 0; j < map->nstash; j++)
+	if (st->be[j].u64 == kbe.u64 && st->i1[j] == si1)
+	    return delstash(map, j, fp47m_find4mg, fp47m_find4st1mg), 1;
+    return 0;
+}
+
+static int FASTCALL fp47m_replace4mg(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos)
+{
+    dFP2I; ResizeI;
+    uint32_t si1 = i1;
+    MigI;
+    union bent kbe = { .tag = tag, .pos = pos };
+    return replace(4, map, i1, i2, si1, kbe, newpos);
+}
+
+static inline unsigned fill(const union bent *b, int bsize)
+{
+    unsigned k = 0;
+    for (int j = 0; j < bsize; j++)
+	k += b[j].tag != 0;
+    return k;
+}
+
+// Move the stashed entries to the squeezed list.
+static inline size_t unstash_all(struct fp47map *map, struct squeezed *sq)
+{
+    struct stash *st = (void *) &map->stash;
+    size_t n = map->nstash;
+    for (size_t j = 0; j < n; j++)
+	sq[j].i1 = st->i1[j], sq[j].be = st->be[j];
+    memset(st, 0, sizeof *st);
+    map->nstash = 0;
+    return n;
+}
+
+// Undo resize4: merge the buckets i and i+nb back into i.
+static int shrink44(struct fp47map *map)
+{
+    size_t nb = (map->mask1 >> 1) + (size_t) 1;
+    union bent *bb = map->bb;
+    size_t nsq = map->nstash;
+    for (size_t i = 0; i < nb; i++) {
+	unsigned k = fill(bb + 4 * i, 4) + fill(bb + 4 * (i + nb), 4);
+	nsq += (k > 4) ? k - 4 : 0;
+    }
+    void *nbb;
+    struct squeezed *sq = malloc((nsq + 1) * sizeof *sq);
+    if (!sq || !allocD2(map, &nbb, nb * 64))
+	return free(sq), -2;
+    size_t n = unstash_all(map, sq);
+    uint32_t mask1 = map->mask1 >> 1;
+    for (size_t i = 0; i < nb; i++) {
+	union bent b[8];
+	memcpy(b + 0, A16(bb + 4 * i), 32);
+	memcpy(b + 4, A16(bb + 4 * (i + nb)), 32);
+	unsigned k = 0;
+	for (unsigned j = 0; j < 8; j++) {
+	    if (b[j].tag == 0)
+		continue;
+	    if (k < 4) {
+		bb[4*i+k++] = b[j];
+		continue;
+	    }
+	    sq[n].i1 = reI(map, i, b[j].tag);
+	    sq[n++].be = b[j];
+	    map->cnt--;
+	}
+	for (; k < 4; k++)
+	    bb[4*i+k] = BE0;
+    }
+    map->bb = freeD2(map, bb, nb * 64, nbb);
+    map->mask1 = mask1;
+    map->logsize1--;
+    setmaxkick(map);
+    if (map->logsize1 == map->logsize0)
+	SetVF(map, 4, );
+    else
+	SetVF(map, 4re, );
+    int rc = reputs(map, sq, n);
+    free(sq);
+    return rc;
+}
+
+// Undo resize2: keep two entries per bucket.
+static int shrink24(struct fp47map *map)
+{
+    size_t nb = map->mask0 + (size_t) 1;
+    union bent *bb = map->bb;
+    size_t nsq = map->nstash;
+    for (size_t i = 0; i < nb; i++) {
+	unsigned k = fill(bb + 4 * i, 4);
+	nsq += (k > 2) ? k - 2 : 0;
+    }
+    void *nbb;
+    struct squeezed *sq = malloc((nsq + 1) * sizeof *sq);
+    if (!sq || !allocD2(map, &nbb, nb * 32))
+	return free(sq), -2;
+    size_t n = unstash_all(map, sq);
+    for (size_t i = 0; i < nb; i++) {
+	union bent b[4];
+	memcpy(b, A16(bb + 4 * i), 32);
+	unsigned k = 0;
+	for (unsigned j = 0; j < 4; j++) {
+	    if (b[j].tag == 0)
+		continue;
+	    if (k < 2) {
+		bb[2*i+k++] = b[j];
+		continue;
+	    }
+	    uint32_t i1 = i, i2 = (i ^ XD(b[j].tag)) & map->mask0;
+	    sq[n].i1 = (i1 < i2) ? i1 : i2;
+	    sq[n++].be = b[j];
+	    map->cnt--;
+	}
+	for (; k < 2; k++)
+	    bb[2*i+k] = BE0;
+    }
+    map->bb = freeD2(map, bb, nb * 32, nbb);
+    map->bsize = 2;
+    SetVF(map, 2, );
+    int rc = reputs(map, sq, n);
+    free(sq);
+    return rc;
+}
+
+int fp47m_shrink(struct fp47map *map)
+{
+    int ret = 0;
+    while (map->bsize == 4) {
+	size_t cnt = map->cnt + map->nstash;
+	int rc;
+	if (map->logsize1 > map->logsize0) {
+	    if (!low4(cnt, map->mask1 >> 1, map->load4))
+		break;
+	    rc = shrink44(map);
+	}
+	else {
+	    if (!low2(cnt, map->mask0, map->load2))
+		break;
+	    rc = shrink24(map);
+	}
+	if (rc != 1)
+	    return (rc < 0) ? rc : ret;
+	ret = 1;
+    }
+    return ret;
+}
+
+// Try harder to move the stashed entries to the buckets.
+int fp47m_drain(struct fp47map *map)
+{
+    struct squeezed sq[4];
+    uint8_t maxkick = map->maxkick;
+    size_t n = unstash_all(map, sq);
+    fp47m_setvf(map);
+    map->maxkick = 255;
+    int rc = reputs(map, sq, n);
+    map->maxkick = maxkick;
+    if (rc < 0)
+	return rc;
+    return map->nstash == 0;
+}
+
+// Grow the table in advance, so that it can hold n entries.
+int fp47m_reserve(struct fp47map *map, size_t n)
+{
+    int ret = 0;
+    while (1) {
+	int rc;
+	if (map->bsize == 2) {
+	    if (!full2(n, map->mask0, map->load2))
+		break;
+	    rc = fp47m_resize2(map, 0, BE0);
+	}
+	else {
+	    if (!full4(n, map->mask1, map->load4))
+		break;
+	    rc = fp47m_resize4(map, 0, BE0, false);
+	}
+	if (rc < 0)
+	    return rc;
+	ret = 1;
+    }
+    return ret;
+}
+
+// Complete the split of the buckets.
+int fp47m_migrate(struct fp47map *map)
+{
+    if (map->mig)
+	split(map, map->mig);
+    return 1;
+}
+
+void fp47m_setvf(struct fp47map *map)
+{
+    bool re = map->logsize1 > map->logsize0;
+    if (map->bsize == 2) {
+	SetVF(map, 2, );
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find2st1 : fp47m_find2st4;
+    }
+    else if (!re) {
+	SetVF(map, 4, );
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1 : fp47m_find4st4;
+    }
+    else if (map->mig) {
+	SetVF(map, 4mg, );
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1mg : fp47m_find4st4mg;
+    }
+    else {
+	SetVF(map, 4re, );
+	if (map->nstash)
+	    map->find = (map->nstash == 1) ? fp47m_find4st1re : fp47m_find4st4re;
+    }
 }
@@ -64,6 +64,188 @@ extern "C" {
 struct fp47map *fp47map_new(int logsize);
 void fp47map_free(struct fp47map *map);
 
+// Custom memory management for the buckets, e.g. to place them in an arena.
+// The blocks must be aligned to the align argument (a power of two, up to 64).
+// The grow hook is optional: it should enlarge the block preserving its
+// contents, in place if possible, or else move it (like mremap with
+// MREMAP_MAYMOVE); on failure, it returns NULL and leaves the block intact.
+// Without the hook, a new block is allocated and the old one is freed.
+// The blocks need not be zeroed.  Each hook receives the ctx pointer.
+// The structure is not copied, and must outlive the map.
+struct fp47map_alloc {
+    void *(*alloc)(void *ctx, size_t size, size_t align);
+    void *(*grow)(void *ctx, void *p, size_t size, size_t newsize, size_t align);
+    void (*free)(void *ctx, void *p, size_t size);
+    void *ctx;
+};
+struct fp47map *fp47map_new_alloc(int logsize, const struct fp47map_alloc *alloc);
+
+// Shrink the map after many entries have been deleted, to release memory.
+// The resizes are undone one by one, for as long as the smaller map would
+// be at most half full.  Returns 1 if the map has been shrunk, 0 if not,
+// or a negative value on failure (same as with fp47map_insert).
+int fp47map_shrink(struct fp47map *map);
+
+// When the number of entries is known in advance, the map can be sized
+// up front, which avoids the intermediate resizes and their memory peaks.
+// fp47map_new_capacity picks the bucket size and the number of buckets
+// for n entries; fp47map_reserve grows an existing map.  The latter returns
+// 1 if the map has been resized, 0 if it is already big enough, or a
+// negative value on failure (same as with fp47map_insert).
+struct fp47map *fp47map_new_capacity(size_t n);
+int fp47map_reserve(struct fp47map *map, size_t n);
+
+// Create a map with 2-entry or 4-entry buckets, in the generic layout
+// (simd = 0) or in the layout of the best SIMD backend the CPU supports
+// (simd = 1; fails with ENOTSUP if there is none).  This is for the code
+// which probes the buckets on its own, such as fp47map.hpp.
+struct fp47map *fp47map_new_layout(int logsize, int bsize, int simd);
+
+// Back the buckets with 2M pages, which reduces TLB misses on big maps.
+// Explicit huge pages (MAP_HUGETLB) are used if a trial 2M mapping succeeds,
+// otherwise transparent huge pages (MADV_HUGEPAGE); this applies to the
+// current buckets and to those allocated on resize, once they grow past 2M.
+// Returns 2 if the buckets are (or will be) in explicit huge pages, 1 if
+// transparent huge pages are enabled (the kernel may still use 4K pages),
+// or 0 if neither is possible (which is also the case with a custom
+// allocator).
+// Later calls report the current state, which can degrade from 2 to 1
+// when the huge page pool is exhausted.
+int fp47map_hugepages(struct fp47map *map);
+
+// Save the map to a file, and load it back.  The file is only good for the
+// same kind of machine and library build.  fp47map_save returns 0 on success,
+// or -1 with errno set.  fp47map_open_mmap maps the buckets copy-on-write,
+// without reading them: the pages are loaded lazily and shared with other
+// processes which open the same file (until modified).  Returns NULL with
+// errno set on failure.  The map can still be modified, and should be freed
+// with fp47map_free() as usual.
+int fp47map_save(const struct fp47map *map, int fd);
+struct fp47map *fp47map_open_mmap(const char *path);
+
+// Make the map read-only, once it is built.  The stashed entries are moved
+// to the buckets, if possible, so that lookups need not check the stash.
+// Any further modifications fail with -3 (insert, delete, replace, shrink,
+// reserve), and big buckets are write-protected.  Returns 1 if the stash
+// is empty, 0 if some entries remain stashed, or a negative value on failure.
+int fp47map_freeze(struct fp47map *map);
+
+// Incremental resizing bounds the latency of inserts on big maps: when the
+// buckets are doubled, they are not split all at once, but a few at a time
+// on subsequent inserts (lookups meanwhile check the unsplit buckets).
+// This only applies to the buckets which grow in place (big maps with the
+// default allocator, or with a grow hook); 2 is also returned by the insert
+// which completes the split.  Turning it off completes the pending split.
+// Other operations on the whole map, such as shrink or freeze, complete
+// the split as well.
+void fp47map_incremental(struct fp47map *map, int on);
+
+// Resize big maps with several threads: the buckets are converted range by
+// range in parallel (only the stashed entries are then reinserted serially).
+// With a thread pool, the ranges are submitted as nthreads tasks: the run hook
+// must call task(arg, j) for each j below n, and return once they are done.
+// Without the pool, nthreads - 1 threads are started for each resize.
+// The pool structure is not copied, and must outlive the map.  By default,
+// nthreads = 1, and the resizes are done by the caller's thread.
+#define FP47MAP_MAXTHREADS 256
+struct fp47map_pool {
+    void (*run)(void *ctx, unsigned n, void (*task)(void *arg, unsigned j), void *arg);
+    void *ctx;
+};
+void fp47map_threads(struct fp47map *map, int nthreads, const struct fp47map_pool *pool);
+
+// Trade memory for speed, or the other way around.  The map is resized when
+// the load factor exceeds maxload percent (with 4-entry buckets, about 90
+// by default); higher loads save memory but need longer kick chains, which
+// the maxkick limit allows (up to 255 kicks per insert; by default, the limit
+// grows with the map, from 8 to 160).  The map starts with 2-entry buckets,
+// which are faster, and converts them to 4-entry buckets above maxload2
+// percent (78 by default, or maxload if lower): lower values convert eagerly,
+// higher lazily, but not above maxload.  Zero fields select the defaults.
+// The limits are not saved with the map, and under FP47M_BRIM the loads are
+// ignored.  Returns 0, or -1 if the values are out of range.
+struct fp47map_policy {
+    unsigned maxload, maxload2, maxkick;
+};
+int fp47map_policy(struct fp47map *map, const struct fp47map_policy *policy);
+
+// Build a map from n entries at once, with nthreads threads: the map is sized
+// up front, the entries are partitioned by bucket range, and the partitions
+// are filled in parallel; the few entries which would have to be kicked
+// to another partition are then inserted serially.  The map is left with
+// nthreads for resizing.  Returns NULL on failure.
+struct fp47map *fp47map_build(const uint64_t *fps, const uint32_t *pos, size_t n, int nthreads);
+
+// Visit all the entries: func is called with the index of the bucket which
+// holds the entry, its tag, and its position; the stashed entries come last,
+// with the index under which they are stashed.  If func returns non-zero,
+// the iteration stops, and the value is returned (otherwise 0 is returned).
+// The map must not be modified meanwhile, except with fp47map_replace.
+// fp47map_foreach_range visits the buckets [lo,hi) only, for parallel scans
+// over [0,fp47map_nbuckets(map)); the range which starts at 0 also gets the
+// stashed entries.
+int fp47map_foreach(const struct fp47map *map,
+	int (*func)(void *arg, uint32_t i, uint32_t tag, uint32_t pos), void *arg);
+int fp47map_foreach_range(const struct fp47map *map, size_t lo, size_t hi,
+	int (*func)(void *arg, uint32_t i, uint32_t tag, uint32_t pos), void *arg);
+
+// Statistics, to see why the map resized early or why lookups got slower.
+// The counters are compiled out by default; to enable them, build both
+// the library and its callers with -DFP47M_STATS (the lookups and inserts
+// are counted by the inline functions below).  The counters are not atomic
+// increments, and are only approximate under concurrent modifications.
+// The map cannot tell the false positives from the genuine duplicates, and
+// so the lookups with more than one match are counted instead.  The kicks
+// are the iterations in the kick loop; kickhist[k] counts the inserts which
+// needed up to (k+1)/8 of maxkick kicks, and kickfail the ones which ran out
+// of kicks (and went to the stash or resized the map).  The time spent in
+// resizing (resize_ns) includes the reinsertion of the stash (restash_ns).
+// The concurrent map and fp47map_build bypass the inline functions, and so
+// their lookups and inserts are not fully counted; the sharded map counts
+// them in its shards (see fp47map_sharded_stats).
+// fp47map_stats fills st with the counters accumulated since the map was
+// created, and returns 0, or returns -1 (with st zeroed) if the library
+// is built without the stats.
+struct fp47map_stats {
+    uint64_t finds, hits, multi;
+    uint64_t sthits, stashed;
+    uint64_t inserts, kicks, kickhist[8], kickfail;
+    uint64_t resizes, resize_ns, restash_ns;
+};
+int fp47map_stats(const struct fp47map *map, struct fp47map_stats *st);
+
+// Analyze the occupancy of the buckets, e.g. to see how full the map gets
+// with real keys before it resizes.  fill[k] is the number of buckets which
+// hold k entries (the buckets not yet split by an incremental resize count
+// as empty).  Each entry has two buckets, the one under which it would be
+// stashed, and the alternative one: alt is the number of entries which sit
+// in the latter.  The entries with the same tag in the same pair of buckets
+// cannot be told apart by lookups: groups[k] is the number of such groups
+// of k entries (groups[1] counts the entries with distinct tags).  The load
+// is (cnt + nstash) / (nbuckets * bsize).  Big maps are scanned in parallel,
+// with the threads set by fp47map_threads.
+struct fp47map_analysis {
+    size_t nbuckets, cnt;
+    unsigned bsize, nstash;
+    double load;
+    size_t fill[5], alt, groups[9];
+    struct { uint32_t i, tag, pos; } stash[4];
+};
+void fp47map_analyze(const struct fp47map *map, struct fp47map_analysis *an);
+
+// The concurrent map: fp47map_mt_find can be called from any number of
+// threads without locking, and so can fp47map_mt_insert (the return values
+// are the same as with fp47map_insert).  The writers lock only the buckets
+// they modify, and have the map to themselves only to resize it or to stash
+// an entry.  The readers never block the writers, and only retry when their
+// buckets are modified under them.  The regular map is not affected, and
+// should be preferred when there is only one thread.
+struct fp47map_mt;
+struct fp47map_mt *fp47map_mt_new(int logsize);
+void fp47map_mt_free(struct fp47map_mt *mt);
+int fp47map_mt_insert(struct fp47map_mt *mt, uint64_t fp, uint32_t pos);
+unsigned fp47map_mt_find(struct fp47map_mt *mt, uint64_t fp, uint32_t *mpos);
+
 // Since the buckets are fixed-size, the map guarantees O(1) worst-case lookup.
 // Use FP47MAP_MAXFIND to specify the array size for fp47map_find().
 #define FP47MAP_MAXFIND 12
@@ -78,15 +260,24 @@ void fp47map_free(struct fp47map *map);
 struct fp47map {
     // To reduce the failure rate, one or two bucket entries can be stashed.
     // There are some details which we do not disclose in this header file.
-    // This guy goes first and gets the best alignment (for SIMD loads).
-    unsigned char stash[48];
+    // This guy goes first and gets the best alignment (for SIMD loads);
+    // the size of the structure is also kept a multiple of 16, for arrays.
+    unsigned char stash[48] __attribute__((aligned(16)));
     // Virtual functions, depend on the bucket size, switched on resize.
     // Pass fp arg first, eax:edx may hold hash() return value.
     unsigned (FP47M_FASTCALL *find)(uint64_t fp, const struct fp47map *map, uint32_t *mpos);
     int (FP47M_FASTCALL *insert)(uint64_t fp, struct fp47map *map, uint32_t pos);
     void (FP47M_FASTCALL *prefetch)(uint64_t fp, const struct fp47map *map);
+    void (FP47M_FASTCALL *find_batch)(const struct fp47map *map, const uint64_t *fps, size_t n,
+	    uint32_t (*mpos)[FP47MAP_MAXFIND], unsigned *nfound);
+    int (FP47M_FASTCALL *insert_batch)(struct fp47map *map, const uint64_t *fps,
+	    const uint32_t *pos, size_t n);
+    int (FP47M_FASTCALL *erase)(uint64_t fp, struct fp47map *map, uint32_t pos);
+    int (FP47M_FASTCALL *replace)(uint64_t fp, struct fp47map *map, uint32_t pos, uint32_t newpos);
     // The buckets (malloc'd); each bucket has bsize entries.
     void *bb;
+    // The custom allocator for the buckets, or NULL.
+    const struct fp47map_alloc *alloc;
     // The total number of entries added to buckets,
     // not including the stashed entries.
     size_t cnt;
@@ -100,28 +291,137 @@ struct fp47map {
     uint32_t mask0, mask1;
     // Max iterations in the kick loop.
     uint8_t maxkick;
+    // The SIMD backend, which also determines the bucket layout.
+    uint8_t simd;
+    // Huge pages for the buckets: 0 none, 1 transparent, 2 explicit.
+    uint8_t huge;
+    // Incremental resizing is enabled.
+    uint8_t incr;
+    // While resizing incrementally, the number of buckets in the lower half
+    // which are yet to be split (they still hold the entries for both halves).
+    uint32_t mig;
+    // The number of threads for resizing, and the caller's thread pool.
+    uint16_t nthreads;
+    // The fill limits for 2-entry and 4-entry buckets, in 1/256ths of
+    // the slots, and the kick limit (0 if it grows with the map).
+    uint16_t load2, load4;
+    uint8_t kickmax;
+    // Set by fp47map_freeze, the buckets are read-only.
+    uint8_t frozen;
+    const struct fp47map_pool *pool;
+    // The counters, allocated with the map if built with FP47M_STATS.
+    struct fp47map_stats *stats;
 };
 
+#ifdef FP47M_STATS
+#define FP47M_STAT(map, field, n) \
+    do if ((map)->stats) { \
+	uint64_t *p_ = &(map)->stats->field; \
+	__atomic_store_n(p_, __atomic_load_n(p_, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED); \
+    } while (0)
+#else
+#define FP47M_STAT(map, field, n) ((void) 0)
+#endif
+
 // Obtain the set of positions matching a fingerprint.
 // Returns the number of matches found (up to FP47MAP_MAXFIND, typically 0 or 1).
 static inline unsigned fp47map_find(const struct fp47map *map, uint64_t fp,
 	uint32_t mpos[FP47MAP_MAXFIND])
 {
-    return map->find(fp, map, mpos);
+    unsigned n = map->find(fp, map, mpos);
+#ifdef FP47M_STATS
+    FP47M_STAT(map, finds, 1);
+    FP47M_STAT(map, hits, n > 0);
+    FP47M_STAT(map, multi, n > 1);
+#endif
+    return n;
 }
 
 // Insert a new entry, that is, a new position associated with a fingerprint.
 static inline int fp47map_insert(struct fp47map *map, uint64_t fp, uint32_t pos)
 {
+    FP47M_STAT(map, inserts, 1);
     return map->insert(fp, map, pos);
 }
 
+// Delete an entry, i.e. the position associated with a fingerprint.
+// Returns 1 if the entry has been found and deleted, 0 otherwise.
+static inline int fp47map_delete(struct fp47map *map, uint64_t fp, uint32_t pos)
+{
+    return map->erase(fp, map, pos);
+}
+
+// Change the position of an existing entry.  Returns 1 on success,
+// 0 if the entry (the fingerprint with the old position) is not found.
+static inline int fp47map_replace(struct fp47map *map, uint64_t fp,
+	uint32_t pos, uint32_t newpos)
+{
+    return map->replace(fp, map, pos, newpos);
+}
+
 // Prefetch the buckets related to a fingerprint.
 static inline void fp47map_prefetch(const struct fp47map *map, uint64_t fp)
 {
     map->prefetch(fp, map);
 }
 
+// Look up a batch of fingerprints.  This is faster than calling fp47map_find()
+// in a loop: the vfunc is dispatched only once, and the buckets are prefetched
+// a few keys ahead, to hide the memory latency.  The number of matches for
+// fps[i] is stored in nfound[i], and the positions in mpos[i].
+static inline void fp47map_find_batch(const struct fp47map *map,
+	const uint64_t *fps, size_t n,
+	uint32_t mpos[][FP47MAP_MAXFIND], unsigned nfound[])
+{
+    map->find_batch(map, fps, n, mpos, nfound);
+#ifdef FP47M_STATS
+    FP47M_STAT(map, finds, n);
+    for (size_t i = 0; i < n; i++) {
+	FP47M_STAT(map, hits, nfound[i] > 0);
+	FP47M_STAT(map, multi, nfound[i] > 1);
+    }
+#endif
+}
+
+// Insert a batch of entries, fps[i] associated with pos[i].  Stops at the
+// first failure.  The return value is the same as with fp47map_insert(),
+// e.g. 2 indicates that the map has been resized along the way.
+static inline int fp47map_insert_batch(struct fp47map *map,
+	const uint64_t *fps, const uint32_t *pos, size_t n)
+{
+    FP47M_STAT(map, inserts, n);
+    return map->insert_batch(map, fps, pos, n);
+}
+
+// The number of buckets, the upper bound for fp47map_foreach_range.
+static inline size_t fp47map_nbuckets(const struct fp47map *map)
+{
+    return map->mask1 + (size_t) 1;
+}
+
+// The sharded map: a simpler way to scale, with 2^logshards independent maps
+// selected by the top bits of the fingerprint, each behind its own lock
+// (a reader-writer lock, so the lookups in the same shard do not block each
+// other).  The logsize is for the whole map.  Each shard resizes on its own,
+// and so the resize pauses are smaller and spread out.  The batch functions
+// group the keys by shard, and lock each shard once per group.  The insert
+// batch stops at the first failure, but the keys routed to the other shards
+// may have been inserted already.  fp47map_sharded_stats adds up the counters
+// of the shards, like fp47map_stats.
+#define FP47MAP_MAXLOGSHARDS 8
+struct fp47map_sharded;
+struct fp47map_sharded *fp47map_sharded_new(int logshards, int logsize);
+void fp47map_sharded_free(struct fp47map_sharded *s);
+unsigned fp47map_sharded_find(struct fp47map_sharded *s, uint64_t fp, uint32_t *mpos);
+int fp47map_sharded_insert(struct fp47map_sharded *s, uint64_t fp, uint32_t pos);
+int fp47map_sharded_delete(struct fp47map_sharded *s, uint64_t fp, uint32_t pos);
+void fp47map_sharded_find_batch(struct fp47map_sharded *s,
+	const uint64_t *fps, size_t n,
+	uint32_t mpos[][FP47MAP_MAXFIND], unsigned nfound[]);
+int fp47map_sharded_insert_batch(struct fp47map_sharded *s,
+	const uint64_t *fps, const uint32_t *pos, size_t n);
+int fp47map_sharded_stats(struct fp47map_sharded *s, struct fp47map_stats *st);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
@@ -0,0 +1,359 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The C++ front end (C++17).  With fp47map.h, each lookup is an indirect call
+// through map->find, which cannot be inlined.  Here the bucket size and the
+// layout are template parameters, and so find and insert probe the buckets
+// inline, the same way the backends do: the matches come in the same order,
+// and the entries go to the same slots.  When the caller is built with
+// -mssse3 or better, Layout::SIMD compiles to the kernels of fp47m-sse4.c
+// (and to the AVX-512 one with -mavx512vl); otherwise the buckets are checked
+// with SSE2 or plain C++.  The resize state is checked at
+// runtime: the kernels handle the map as it is created (fp47map_new_layout)
+// and as it is after the resizes, while the stashed entries, the incremental
+// splits, the slow path of insert (the kicks), and the inserts into
+// a frozen map go through the vfuncs.
+// 2-entry buckets are converted to 4-entry buckets on the first resize,
+// after which Map<L, 2> only makes the vfunc calls; for the maps which grow,
+// Map<L, 4> is a better fit.  The library and its C++ callers must be built
+// with the same FP47M_WINDOW and FP47M_STATS settings.
+//
+//	fp47::Map<fp47::Layout::SIMD, 4> map(10);
+//	map.insert(fp, pos);
+//	uint32_t mpos[FP47MAP_MAXFIND];
+//	unsigned n = map.find(fp, mpos);
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "fp47map.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Static linking only, see fp47map.h.
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+namespace fp47 {
+
+// The generic backend interleaves the tags and the positions.  The SIMD
+// backends keep them apart in 4-entry buckets (four tags, then four positions),
+// and check a bucket at a time.
+enum class Layout { Generic, SIMD };
+
+template<Layout L, unsigned B>
+class Map {
+    static_assert(B == 2 || B == 4, "the buckets have 2 or 4 entries");
+public:
+    // Throws std::bad_alloc on failure, including when Layout::SIMD
+    // is not supported by the CPU.
+    explicit Map(int logsize)
+	: map_(fp47map_new_layout(logsize, B, L == Layout::SIMD))
+    {
+	if (!map_)
+	    throw std::bad_alloc();
+    }
+    ~Map() { fp47map_free(map_); }
+    Map(const Map &) = delete;
+    Map &operator=(const Map &) = delete;
+    Map(Map &&o) noexcept : map_(o.map_) { o.map_ = nullptr; }
+
+    // The underlying map, for the rest of the C API.
+    struct fp47map *get() const { return map_; }
+
+    // Same as fp47map_find.
+    unsigned find(uint64_t fp, uint32_t mpos[FP47MAP_MAXFIND]) const
+    {
+	const struct fp47map *map = map_;
+	unsigned n;
+	if (__builtin_expect(inlined(map), 1))
+	    n = (map->logsize1 == map->logsize0) ?
+		probe<false>(map, fp, mpos) : probe<true>(map, fp, mpos);
+	else
+	    n = map->find(fp, map, mpos);
+#ifdef FP47M_STATS
+	FP47M_STAT(map, finds, 1);
+	FP47M_STAT(map, hits, n > 0);
+	FP47M_STAT(map, multi, n > 1);
+#endif
+	return n;
+    }
+
+    // Same as fp47map_insert.
+    int insert(uint64_t fp, uint32_t pos)
+    {
+	struct fp47map *map = map_;
+	FP47M_STAT(map, inserts, 1);
+	if (__builtin_expect(inlined(map) && !map->frozen, 1)) {
+	    bool ok = (map->logsize1 == map->logsize0) ?
+		put<false>(map, fp, pos) : put<true>(map, fp, pos);
+	    if (__builtin_expect(ok, 1))
+		return map->cnt++, 1;
+	}
+	return map->insert(fp, map, pos);
+    }
+
+    int erase(uint64_t fp, uint32_t pos) { return map_->erase(fp, map_, pos); }
+    int replace(uint64_t fp, uint32_t pos, uint32_t newpos)
+    {
+	return map_->replace(fp, map_, pos, newpos);
+    }
+    void prefetch(uint64_t fp) const { map_->prefetch(fp, map_); }
+    size_t size() const { return map_->cnt + map_->nstash; }
+private:
+    struct fp47map *map_;
+
+    // The state which the kernels handle.
+    static bool inlined(const struct fp47map *map)
+    {
+	return map->bsize == B && (map->simd != 0) == (L == Layout::SIMD) &&
+	       map->nstash == 0 && map->mig == 0;
+    }
+
+    // 1 + fp % UINT32_MAX, see mod32 in fp47m.h.
+    static uint32_t mod32(uint64_t fp)
+    {
+	uint32_t lo = fp;
+	uint32_t hi = fp >> 32;
+	lo += 1;
+	if (__builtin_expect(lo == 0, 0))
+	    lo = 1;
+	lo += hi;
+	lo += (lo < hi);
+	return lo;
+    }
+
+    static uint32_t xd(uint32_t tag)
+    {
+#ifdef FP47M_WINDOW
+	return (tag >> (32 - FP47M_WINDOW)) | 1;
+#else
+	return tag;
+#endif
+    }
+
+    // dFP2I, with ResizeI if Re.
+    template<bool Re>
+    static void index(const struct fp47map *map, uint64_t fp,
+	    uint32_t &i1, uint32_t &i2, uint32_t &tag)
+    {
+	i1 = fp >> 32;
+	tag = mod32(fp);
+	i2 = i1 ^ xd(tag);
+	i1 &= map->mask0;
+	i2 &= map->mask0;
+	if constexpr (Re) {
+	    i1 = (i2 < i1) ? i2 : i1;
+	    i1 |= tag << map->logsize0;
+	    i2 = i1 ^ xd(tag);
+	    i1 &= map->mask1;
+	    i2 &= map->mask1;
+	}
+    }
+
+    // Slot j of a bucket, see tagp and posp in fp47m.h.
+    static constexpr bool apart = L == Layout::SIMD && B == 4;
+    static uint32_t *tagp(uint32_t *b, unsigned j) { return apart ? b + j : b + 2 * j; }
+    static uint32_t *posp(uint32_t *b, unsigned j) { return apart ? b + 4 + j : b + 2 * j + 1; }
+
+    // Slot k in the order of the matches: the generic backend alternates
+    // between the buckets, the SIMD backends check b1, then b2.
+    // The bucket is selected with a mask rather than a branch, which would
+    // be mispredicted on every other hit.
+    static uint32_t *slot(uint32_t *b1, uint32_t *b2, unsigned k)
+    {
+	ptrdiff_t d = b2 - b1;
+	if constexpr (L == Layout::Generic)
+	    return posp(b1 + (d & -(ptrdiff_t) (k & 1)), k >> 1);
+	else
+	    return posp(b1 + (d & -(ptrdiff_t) (k >= B)), k % B);
+    }
+
+    // The bitmask of the matching slots of the two buckets, in the order
+    // of slot(), and the position of the single match, if any (on a miss,
+    // any position).  With SSE2, the tags and the positions are gathered
+    // into vectors in that order, and the position is picked with the
+    // result of the compare, rather than loaded by the index of the match.
+    static unsigned match(uint32_t *b1, uint32_t *b2, uint32_t tag, uint32_t &pos)
+    {
+	unsigned m = 0;
+#ifdef __SSE2__
+#define Load(p) _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (p)))
+#define Cast(x) _mm_castps_si128(x)
+	__m128i t = _mm_set1_epi32(tag);
+	__m128i xtag1, xpos1, xtag2, xpos2;
+	if constexpr (apart) {
+	    xtag1 = Cast(Load(b1)), xpos1 = Cast(Load(b1 + 4));
+	    xtag2 = Cast(Load(b2)), xpos2 = Cast(Load(b2 + 4));
+	}
+	else if constexpr (B == 2) {
+	    xtag1 = Cast(_mm_shuffle_ps(Load(b1), Load(b2), 0x88));
+	    xpos1 = Cast(_mm_shuffle_ps(Load(b1), Load(b2), 0xdd));
+	    if constexpr (L == Layout::Generic) {
+		xtag1 = _mm_shuffle_epi32(xtag1, 0xd8);
+		xpos1 = _mm_shuffle_epi32(xpos1, 0xd8);
+	    }
+	}
+	else {
+	    __m128i x1 = Cast(_mm_shuffle_ps(Load(b1), Load(b1 + 4), 0x88));
+	    __m128i y1 = Cast(_mm_shuffle_ps(Load(b1), Load(b1 + 4), 0xdd));
+	    __m128i x2 = Cast(_mm_shuffle_ps(Load(b2), Load(b2 + 4), 0x88));
+	    __m128i y2 = Cast(_mm_shuffle_ps(Load(b2), Load(b2 + 4), 0xdd));
+	    xtag1 = _mm_unpacklo_epi32(x1, x2), xpos1 = _mm_unpacklo_epi32(y1, y2);
+	    xtag2 = _mm_unpackhi_epi32(x1, x2), xpos2 = _mm_unpackhi_epi32(y1, y2);
+	}
+	__m128i xcmp = _mm_cmpeq_epi32(xtag1, t);
+	__m128i xsel = _mm_and_si128(xcmp, xpos1);
+	m = _mm_movemask_ps(_mm_castsi128_ps(xcmp));
+	if constexpr (B == 4) {
+	    xcmp = _mm_cmpeq_epi32(xtag2, t);
+	    xsel = _mm_or_si128(xsel, _mm_and_si128(xcmp, xpos2));
+	    m |= _mm_movemask_ps(_mm_castsi128_ps(xcmp)) << 4;
+	}
+	xsel = _mm_or_si128(xsel, _mm_shuffle_epi32(xsel, 0x4e));
+	xsel = _mm_or_si128(xsel, _mm_shuffle_epi32(xsel, 0xb1));
+	pos = _mm_cvtsi128_si32(xsel);
+#undef Load
+#undef Cast
+#else
+	for (unsigned j = 0; j < B; j++) {
+	    if constexpr (L == Layout::Generic)
+		m |= (*tagp(b1, j) == tag) << 2 * j | (*tagp(b2, j) == tag) << (2 * j + 1);
+	    else
+		m |= (*tagp(b1, j) == tag) << j | (*tagp(b2, j) == tag) << (B + j);
+	}
+	pos = *slot(b1, b2, __builtin_ctz(m | 1U << (2 * B - 1)));
+#endif
+	return m;
+    }
+
+#if defined(__SSSE3__)
+    // The kernels of fp47m-sse4.c, when the caller is built for SSSE3:
+    // the matching positions are compacted with pshufb (lut.leftpack).
+    struct Leftpack {
+	uint8_t b[16][16];
+	constexpr Leftpack() : b{}
+	{
+	    for (unsigned m = 0; m < 16; m++) {
+		unsigned k = 0;
+		for (unsigned j = 0; j < 4; j++)
+		    if (m >> j & 1) {
+			for (unsigned c = 0; c < 4; c++)
+			    b[m][4 * k + c] = 4 * j + c;
+			k++;
+		    }
+		for (k *= 4; k < 16; k++)
+		    b[m][k] = 0xff;
+	    }
+	}
+    };
+    static constexpr Leftpack leftpack{};
+
+    // The popcount of a 4-bit mask, see popcnt4 in fp47m-sse4.c.
+#ifdef __POPCNT__
+    static unsigned popcnt4(unsigned m) { return __builtin_popcount(m); }
+#else
+    static unsigned popcnt4(unsigned m) { return 0x4332322132212110ULL >> 4 * m & 15; }
+#endif
+
+    static unsigned find4(__m128i xtag, __m128i xpos, uint32_t tag, uint32_t *mpos)
+    {
+	__m128i xcmp = _mm_cmpeq_epi32(xtag, _mm_set1_epi32(tag));
+	unsigned m = _mm_movemask_ps(_mm_castsi128_ps(xcmp));
+	__m128i xlp = _mm_loadu_si128((const __m128i *) leftpack.b[m]);
+	_mm_storeu_si128((__m128i *) mpos, _mm_shuffle_epi8(xpos, xlp));
+	return popcnt4(m);
+    }
+
+    // Check both buckets, the matches in b1 go first.
+    static unsigned kernel(uint32_t *b1, uint32_t *b2, uint32_t tag, uint32_t *mpos)
+    {
+#define Load(p) _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (p)))
+#define Cast(x) _mm_castps_si128(x)
+	if constexpr (B == 2)
+	    return find4(Cast(_mm_shuffle_ps(Load(b1), Load(b2), 0x88)),
+			 Cast(_mm_shuffle_ps(Load(b1), Load(b2), 0xdd)), tag, mpos);
+	else {
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	    __m256i ytag = _mm256_inserti128_si256(_mm256_castsi128_si256(Cast(Load(b1))), Cast(Load(b2)), 1);
+	    __m256i ypos = _mm256_inserti128_si256(_mm256_castsi128_si256(Cast(Load(b1 + 4))), Cast(Load(b2 + 4)), 1);
+	    __mmask8 m = _mm256_cmpeq_epi32_mask(ytag, _mm256_set1_epi32(tag));
+	    _mm256_storeu_si256((__m256i *) mpos, _mm256_maskz_compress_epi32(m, ypos));
+	    return popcnt4(m & 15) + popcnt4(m >> 4);
+#else
+	    unsigned n = find4(Cast(Load(b1)), Cast(Load(b1 + 4)), tag, mpos);
+	    return   n + find4(Cast(Load(b2)), Cast(Load(b2 + 4)), tag, mpos + n);
+#endif
+	}
+#undef Load
+#undef Cast
+    }
+#endif
+
+    // The loop only runs for the multiple matches.
+    template<bool Re>
+    static unsigned probe(const struct fp47map *map, uint64_t fp, uint32_t *mpos)
+    {
+	uint32_t i1, i2, tag;
+	index<Re>(map, fp, i1, i2, tag);
+	uint32_t *b1 = (uint32_t *) map->bb + 2 * B * (size_t) i1;
+	uint32_t *b2 = (uint32_t *) map->bb + 2 * B * (size_t) i2;
+#if defined(__SSSE3__)
+	if constexpr (L == Layout::SIMD)
+	    return kernel(b1, b2, tag, mpos);
+#endif
+	unsigned m = match(b1, b2, tag, mpos[0]);
+	if (__builtin_expect(m & (m - 1), 0)) {
+	    unsigned n = 0;
+	    do
+		mpos[n++] = *slot(b1, b2, __builtin_ctz(m));
+	    while (m &= m - 1);
+	    return n;
+	}
+	return m != 0;
+    }
+
+    // Put the entry into a free slot, alternating between the buckets,
+    // like all the backends do.  Returns false if both buckets are full.
+    template<bool Re>
+    static bool put(struct fp47map *map, uint64_t fp, uint32_t pos)
+    {
+	uint32_t i1, i2, tag;
+	index<Re>(map, fp, i1, i2, tag);
+	uint32_t *b1 = (uint32_t *) map->bb + 2 * B * (size_t) i1;
+	uint32_t *b2 = (uint32_t *) map->bb + 2 * B * (size_t) i2;
+	for (unsigned j = 0; j < B; j++) {
+	    if (*tagp(b1, j) == 0)
+		return *tagp(b1, j) = tag, *posp(b1, j) = pos, true;
+	    if (*tagp(b2, j) == 0)
+		return *tagp(b2, j) = tag, *posp(b2, j) = pos, true;
+	}
+	return false;
+    }
+};
+
+} // namespace fp47
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
@@ -0,0 +1,121 @@
+// Copyright (c) 2020 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// fp47::Map must build the same buckets as the C API, and find the same
+// positions, in the same order.
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include "fp47map.hpp"
+
+// A hashing primitive, by Pelle Evensen.
+static inline uint64_t nasam(uint64_t x)
+{
+#define ror64(x, k) (x >> k | x << (64 - k))
+    x ^= ror64(x, 25) ^ ror64(x, 47);
+    x *= 0x9e6c63d0676a9a99;
+    x ^= x >> 23 ^ x >> 51;
+    x *= 0x9e6d62d06f6a9a9b;
+    x ^= x >> 23 ^ x >> 51;
+    return x;
+}
+
+static void same(const struct fp47map *a, const struct fp47map *b)
+{
+    assert(a->bsize == b->bsize && a->mask1 == b->mask1);
+    assert(a->cnt == b->cnt && a->nstash == b->nstash && a->mig == b->mig);
+    size_t bytes = (a->mask1 + (size_t) 1) * a->bsize * 8;
+    assert(memcmp(a->bb, b->bb, bytes) == 0);
+}
+
+template<fp47::Layout L, unsigned B>
+static void test(bool incr)
+{
+    fp47::Map<L, B> map(10);
+    struct fp47map *cmap = fp47map_new_layout(10, B, L == fp47::Layout::SIMD);
+    assert(cmap);
+    fp47map_incremental(map.get(), incr);
+    fp47map_incremental(cmap, incr);
+    const unsigned imax = 1 << 18;
+    for (unsigned i = 1; i <= imax; i++) {
+	int rc = map.insert(nasam(i), i);
+	assert(rc > 0 && rc == fp47map_insert(cmap, nasam(i), i));
+	if ((i & (i - 1)) || i < 1024)
+	    continue;
+	same(map.get(), cmap);
+	// The hits and the misses.
+	for (unsigned j = 1; j <= 2 * i; j++) {
+	    uint32_t mpos[FP47MAP_MAXFIND], cpos[FP47MAP_MAXFIND];
+	    unsigned n = map.find(nasam(j), mpos);
+	    assert(n == fp47map_find(cmap, nasam(j), cpos));
+	    assert(memcmp(mpos, cpos, 4 * n) == 0);
+	    assert(n > 0 || j > i);
+	}
+    }
+    assert(map.size() == imax);
+    for (unsigned i = 1; i <= imax; i += 2) {
+	assert(map.erase(nasam(i), i) == 1);
+	assert(fp47map_delete(cmap, nasam(i), i) == 1);
+    }
+    same(map.get(), cmap);
+    fp47map_free(cmap);
+}
+
+// The buckets of a frozen map are write-protected (with a big enough map),
+// so the inserts must not reach them.
+template<fp47::Layout L, unsigned B>
+static void test_frozen()
+{
+    fp47::Map<L, B> map(20);
+    for (unsigned i = 1; i <= 999; i++)
+	assert(map.insert(nasam(i), i) == 1);
+    assert(fp47map_freeze(map.get()) == 1);
+    assert(map.insert(nasam(1000), 1000) == -3);
+    assert(fp47map_insert(map.get(), nasam(1000), 1000) == -3);
+    assert(map.erase(nasam(1), 1) == -3);
+    for (unsigned i = 1; i <= 1000; i++) {
+	uint32_t mpos[FP47MAP_MAXFIND];
+	unsigned n = map.find(nasam(i), mpos);
+	assert(n == (i < 1000) && (n == 0 || mpos[0] == i));
+    }
+    assert(map.size() == 999);
+}
+
+template<fp47::Layout L>
+static void test()
+{
+    test<L, 2>(false);
+    test<L, 4>(false);
+    test<L, 4>(true);
+    test_frozen<L, 2>();
+    test_frozen<L, 4>();
+}
+
+int main()
+{
+    test<fp47::Layout::Generic>();
+#if defined(__i386__) || defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt"))
+	test<fp47::Layout::SIMD>();
+#endif
+    return 0;
+}
@@ -20,7 +20,11 @@
 
 #undef NDEBUG
 #include <stdio.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "fp47m.h"
 
 // A hashing primitive, by Pelle Evensen.
@@ -51,31 +55,65 @@ static void recheck(struct fp47map *map, unsigned imax)
     assert(map->cnt + map->nstash == imax / 2 + 1);
     assert(e0 <= 3);
     assert(e1 <= 1);
+    // The batch lookup must agree with the single lookups.
+    uint64_t fps[37];
+    uint32_t mpos[37][FP47MAP_MAXFIND];
+    unsigned nfound[37];
+    for (unsigned i = 1; i <= imax; i += 2 * 37) {
+	unsigned n = 0;
+	for (unsigned j = i; j <= imax && n < 37; j += 2)
+	    fps[n++] = nasam(j);
+	fp47map_find_batch(map, fps, n, mpos, nfound);
+	for (unsigned j = 0; j < n; j++) {
+	    uint32_t mpos1[FP47MAP_MAXFIND];
+	    assert(nfound[j] == fp47map_find(map, fps[j], mpos1));
+	    assert(memcmp(mpos[j], mpos1, nfound[j] * 4) == 0);
+	}
+    }
+}
+
+// A new map for the backend, with the odd keys up to *imax inserted (key i
+// at position i), unless imax is NULL.  With stash, the inserts past *imax/2
+// stop as soon as the stash is not empty (which happens with -DFP47M_BRIM).
+// *imax is set to the last key inserted.
+static struct fp47map *newmap(int simd, int logsize, unsigned *imax, bool stash)
+{
+    struct fp47map *map = fp47map_new(logsize);
+    assert(map);
+    fp47m_init(map, simd);
+    if (!imax)
+	return map;
+    unsigned last = 0;
+    for (unsigned i = 1; i <= *imax; i += 2) {
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+	last = i;
+	if (stash && i > *imax / 2 && map->nstash)
+	    break;
+    }
+    *imax = last;
+    return map;
 }
 
 // Insert pseudorandom data and hash the buckets after a few resizes.
-static uint64_t test(bool sse4)
+static uint64_t test(int simd, bool batch)
 {
     struct fp47map *map = fp47map_new(10);
     assert(map);
-    if (sse4) {
-#if defined(__i386__) || defined(__x86_64__)
-	map->find = fp47m_find2_sse4;
-	map->insert = fp47m_insert2_sse4;
-	map->prefetch = fp47m_prefetch2_sse4;
-    }
-    else {
-	map->find = fp47m_find2;
-	map->insert = fp47m_insert2;
-	map->prefetch = fp47m_prefetch2;
-#endif
-    }
-    for (unsigned i = 1; i <= UINT16_MAX; i += 2) {
+    fp47m_init(map, simd);
+    for (unsigned i = 1; i <= UINT16_MAX; ) {
 	unsigned nstash = map->nstash;
-	int rc = fp47map_insert(map, nasam(i), i);
+	uint64_t fps[99];
+	uint32_t pos[99];
+	unsigned n = 0;
+	do {
+	    fps[n] = nasam(i), pos[n++] = i;
+	    i += 2;
+	} while (batch && n < 99 && i <= UINT16_MAX);
+	int rc = batch ? fp47map_insert_batch(map, fps, pos, n) :
+			 fp47map_insert(map, fps[0], pos[0]);
 	assert(rc > 0);
 	if (rc == 2 || map->nstash != nstash)
-	    recheck(map, i);
+	    recheck(map, i - 2);
     }
     uint32_t *bb = map->bb;
     uint32_t *bbend = bb + 8 * (map->mask1 + 1);
@@ -83,7 +121,7 @@ static uint64_t test(bool sse4)
     do {
 	uint64_t x0, x1, y0, y1;
 #if defined(__i386__) || defined(__x86_64__)
-	if (sse4) {
+	if (simd) {
 	    x0 = bb[0] | (uint64_t) bb[1] << 32; // tag0 tag1
 	    x1 = bb[2] | (uint64_t) bb[3] << 32; // tag2 tag3
 	    y0 = bb[4] | (uint64_t) bb[5] << 32; // pos0 pos1
@@ -109,11 +147,819 @@ static uint64_t test(bool sse4)
     return h;
 }
 
+// Whether the map is at most half full, relative to the fill limit
+// of the smaller table, and so can be shrunk.
+static bool shrinkable(const struct fp47map *map)
+{
+    size_t cnt = map->cnt + map->nstash;
+    if (map->bsize == 2)
+	return false;
+    if (map->logsize1 > map->logsize0)
+	return low4(cnt, map->mask1 >> 1, map->load4);
+    return low2(cnt, map->mask0, map->load2);
+}
+
+// Replace and delete some of the entries.
+static void test_delete(int simd)
+{
+    // Try to stop with a non-empty stash.
+    unsigned imax = UINT16_MAX;
+    struct fp47map *map = newmap(simd, 10, &imax, true);
+    size_t cnt = map->cnt + map->nstash;
+    for (unsigned i = 1; i <= imax; i += 2) {
+	assert(fp47map_replace(map, nasam(i), i + 1, i) == 0);
+	if (i % 3 == 0)
+	    assert(fp47map_replace(map, nasam(i), i, i + 1) == 1);
+	if (i % 5 == 0)
+	    assert(fp47map_delete(map, nasam(i), i + (i % 3 == 0)) == 1), cnt--;
+    }
+    assert(map->cnt + map->nstash == cnt);
+    // Delete most of the rest, then shrink.  With narrow windows, the map
+    // grows at a lower fill factor, and so it may shrink already.
+    bool low = shrinkable(map);
+#ifndef FP47M_WINDOW
+    assert(!low);
+#endif
+    assert(fp47map_shrink(map) == low);
+    assert(!shrinkable(map));
+    for (int pass = 0; pass < 2; pass++) {
+	unsigned logsize1 = map->logsize1;
+	for (unsigned i = 1; i <= imax; i += 2) {
+	    uint32_t mpos[FP47MAP_MAXFIND];
+	    uint32_t pos = i + (i % 3 == 0);
+	    unsigned n = fp47map_find(map, nasam(i), mpos);
+	    bool found = false;
+	    for (unsigned j = 0; j < n; j++)
+		found |= mpos[j] == pos;
+	    bool live = i % 5 != 0 && (pass == 0 || i % 7 == 0);
+	    assert(found == live);
+	    if (live && (pass == 1 || i % 7 != 0))
+		assert(fp47map_delete(map, nasam(i), pos) == 1);
+	}
+	assert(fp47map_shrink(map) == 1);
+	assert(map->logsize1 < logsize1);
+    }
+    assert(map->logsize1 == map->logsize0);
+    assert(map->cnt == 0 && map->nstash == 0 && map->bsize == 2);
+    fp47map_free(map);
+}
+
+// The fingerprint with the given high bits and tag.
+static uint64_t tagfp(uint32_t hi, uint32_t tag)
+{
+    uint32_t lo = ((uint64_t) tag - 1 + UINT32_MAX - hi % UINT32_MAX) % UINT32_MAX;
+    uint64_t fp = (uint64_t) hi << 32 | lo;
+    assert(mod32(fp) == tag);
+    return fp;
+}
+
+// Keys which share the tag and the buckets: the ones which don't fit
+// in the buckets are stashed, and all of them must be found.  After
+// a resize, the stash is checked with the index from ResizeI, which
+// starts from the lower of the two original indexes.  With the tag
+// 1 << logsize0, the two buckets differ only above mask0, and so have
+// the same low bits; the entries must still be stashed under that index.
+// The kick loop alternates between the two buckets, and which one it ends
+// on depends on maxkick, so this is checked at several sizes.
+static void test_stash(int simd, bool re)
+{
+    for (unsigned logsize = 5; logsize <= (re ? 12 : 5); logsize++) {
+	struct fp47map *map = newmap(simd, 4, NULL, false);
+	unsigned imax = 1;
+	while (re && (map->bsize == 2 || map->logsize1 < logsize)) {
+	    assert(fp47map_insert(map, nasam(imax), imax) > 0);
+	    imax += 2;
+	}
+	uint32_t tag = re ? 1 << map->logsize0 : 12345;
+	unsigned nstash = 0;
+	for (unsigned k = 1; k <= (re ? 10 : 6); k++) {
+	    assert(fp47map_insert(map, tagfp(5 | k << 16, tag), imax + 2 * k) > 0);
+	    if (nstash < map->nstash)
+		nstash = map->nstash;
+	    for (unsigned j = 1; j <= k; j++) {
+		uint32_t mpos[FP47MAP_MAXFIND];
+		unsigned n = fp47map_find(map, tagfp(5 | j << 16, tag), mpos);
+		bool found = false;
+		for (unsigned m = 0; m < n; m++)
+		    found |= mpos[m] == imax + 2 * j;
+		assert(found);
+	    }
+	}
+	assert(nstash > 0);
+	fp47map_free(map);
+    }
+}
+
+// With the map sized in advance, insertions must not resize it.
+static void test_reserve(int simd)
+{
+#ifdef FP47M_BRIM
+    const bool brim = true;
+#else
+    const bool brim = false;
+#endif
+    // With narrow windows, the stash can overflow early, too.
+#ifdef FP47M_WINDOW
+    const bool early = true;
+#else
+    const bool early = brim;
+#endif
+    for (int k = 0; k < 2; k++) {
+	// 55000 entries fit into 4-entry buckets with fewer bytes.
+	struct fp47map *map = k ? fp47map_new(10) : fp47map_new_capacity(55000);
+	assert(map);
+	assert(k || brim || (map->bsize == 4 && map->logsize0 == 14));
+	fp47m_init(map, simd);
+	unsigned i = 1;
+	if (k) {
+	    for (; i <= 999; i += 2)
+		assert(fp47map_insert(map, nasam(i), i) > 0);
+	    assert(fp47map_reserve(map, UINT16_MAX / 2 + 1) == !brim);
+	    recheck(map, i - 2);
+	}
+	for (; i <= UINT16_MAX; i += 2) {
+	    int rc = fp47map_insert(map, nasam(i), i);
+	    assert(rc == 1 || (early && rc == 2));
+	}
+	recheck(map, UINT16_MAX);
+	fp47map_free(map);
+    }
+}
+
+// A numeric sysctl, or 1 if it cannot be read.
+static unsigned long sysctl(const char *path)
+{
+    unsigned long n = 1;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+	if (fscanf(fp, "%lu", &n) != 1)
+	    n = 1;
+	fclose(fp);
+    }
+    return n;
+}
+
+// The buckets must survive the moves to and from huge pages.
+static void test_huge(void)
+{
+    struct fp47map *map = fp47map_new(10);
+    assert(map);
+    int huge = fp47map_hugepages(map);
+    assert(huge >= 0 && huge <= 2);
+    // Without a huge page pool, explicit huge pages are not reported.
+    if (huge == 2)
+	assert(sysctl("/proc/sys/vm/nr_hugepages") || sysctl("/proc/sys/vm/nr_overcommit_hugepages"));
+    unsigned imax = (1 << 19) - 1;
+    for (unsigned i = 1; i <= imax; i += 2) {
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+	size_t bytes = (map->mask1 + (size_t) 1) * map->bsize * 8;
+	if (map->huge == FP47M_HUGE_THP && bytes >= HUGESZ)
+	    assert((uintptr_t) map->bb % HUGESZ == 0);
+    }
+    recheck(map, imax);
+    for (unsigned i = 1025; i <= imax; i += 2)
+	assert(fp47map_delete(map, nasam(i), i) == 1);
+    assert(fp47map_shrink(map) == 1);
+    recheck(map, 1023);
+    fp47map_free(map);
+}
+
+// Custom allocator hooks, which keep track of the memory in use.
+static void *xalloc(void *ctx, size_t size, size_t align)
+{
+    void *p = aligned_alloc(align, size);
+    if (p)
+	*(size_t *) ctx += size;
+    return p;
+}
+
+static void xfree(void *ctx, void *p, size_t size)
+{
+    *(size_t *) ctx -= size;
+    free(p);
+}
+
+static void *xgrow(void *ctx, void *p, size_t size, size_t newsize, size_t align)
+{
+    void *q = xalloc(ctx, newsize, align);
+    if (q)
+	memcpy(q, p, size), xfree(ctx, p, size);
+    return q;
+}
+
+static void test_alloc(int simd)
+{
+    for (int k = 0; k < 2; k++) {
+	size_t inuse = 0;
+	struct fp47map_alloc alloc = { xalloc, k ? xgrow : NULL, xfree, &inuse };
+	struct fp47map *map = fp47map_new_alloc(10, &alloc);
+	assert(map);
+	fp47m_init(map, simd);
+	assert(fp47map_hugepages(map) == 0);
+	unsigned imax = UINT16_MAX;
+	for (unsigned i = 1; i <= imax; i += 2)
+	    assert(fp47map_insert(map, nasam(i), i) > 0);
+	recheck(map, imax);
+	assert(inuse == (map->mask1 + (size_t) 1) * map->bsize * 8);
+	for (unsigned i = 1025; i <= imax; i += 2)
+	    assert(fp47map_delete(map, nasam(i), i) == 1);
+	assert(fp47map_shrink(map) == 1);
+	recheck(map, 1023);
+	assert(inuse == (map->mask1 + (size_t) 1) * map->bsize * 8);
+	fp47map_free(map);
+	assert(inuse == 0);
+    }
+}
+
+// Corrupt the header of a saved map in different ways, then truncate the file:
+// the loader must fail with EINVAL.  The header has the magic and cnt, then
+// the bytes bsize, nstash, logsize0, logsize1, simd and window at 16, then
+// the stash at 24: the bucket indexes first, then the tags (interleaved with
+// the positions in the generic layout).  The map is saved with an empty stash.
+static void badfile(const char *path, bool simd)
+{
+    uint8_t h0[72], h[72];
+    int fd = open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(pread(fd, h0, sizeof h0, 0) == sizeof h0);
+    assert(h0[17] == 0);
+    size_t tag0 = 24 + 16, tag3 = tag0 + 4 * (simd ? 3 : 6);
+    uint32_t one = 1, big = UINT32_MAX;
+    for (int k = 0; k < 6; k++) {
+	memcpy(h, h0, sizeof h);
+	switch (k) {
+	case 0: memcpy(h, "fp47map1", 8); break;
+	case 1: h[16] = 3; break;
+	case 2: h[21] ^= 1; break;
+	// A stashed entry without a tag, or out of the table.
+	case 3: h[17] = 1; break;
+	case 4: h[17] = 1, memcpy(h + tag0, &one, 4), memcpy(h + 24, &big, 4); break;
+	// A tag past nstash.
+	case 5: memcpy(h + tag3, &one, 4); break;
+	}
+	assert(pwrite(fd, h, sizeof h, 0) == sizeof h);
+	errno = 0;
+	assert(fp47map_open_mmap(path) == NULL && errno == EINVAL);
+    }
+    assert(pwrite(fd, h0, sizeof h0, 0) == sizeof h0);
+    struct fp47map *map = fp47map_open_mmap(path);
+    assert(map);
+    fp47map_free(map);
+    off_t size = lseek(fd, 0, SEEK_END);
+    assert(size > 0 && ftruncate(fd, size - 8) == 0);
+    errno = 0;
+    assert(fp47map_open_mmap(path) == NULL && errno == EINVAL);
+    close(fd);
+}
+
+// Save the map, and load it back.
+static void test_save(int simd)
+{
+    unsigned imax = UINT16_MAX / 2;
+    struct fp47map *map = newmap(simd, 10, &imax, false);
+    char path[] = "/tmp/test-fp47map.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(fp47map_save(map, fd) == 0);
+    close(fd);
+    struct fp47map *map2 = fp47map_open_mmap(path);
+    assert(map2);
+    assert(map2->cnt == map->cnt && map2->nstash == map->nstash);
+    assert(map2->mask1 == map->mask1 && map2->bsize == map->bsize);
+    assert(memcmp(map2->bb, map->bb, (map->mask1 + (size_t) 1) * map->bsize * 8) == 0);
+    fp47map_free(map);
+    // The loaded map must be usable for the backend of this CPU.
+    recheck(map2, imax);
+    for (unsigned i = imax + 2; i <= UINT16_MAX; i += 2)
+	assert(fp47map_insert(map2, nasam(i), i) > 0);
+    recheck(map2, UINT16_MAX);
+    fp47map_free(map2);
+    badfile(path, simd != 0);
+    unlink(path);
+}
+
+// A frozen map must keep all its entries, and refuse modifications.
+static void test_freeze(int simd)
+{
+    unsigned imax = UINT16_MAX;
+    struct fp47map *map = newmap(simd, 10, &imax, true);
+    unsigned nstash = map->nstash;
+    int rc = fp47map_freeze(map);
+    assert(rc == (map->nstash == 0));
+    assert(map->nstash <= nstash);
+    recheck(map, imax);
+    assert(fp47map_insert(map, nasam(imax + 2), imax + 2) == -3);
+    assert(fp47map_delete(map, nasam(1), 1) == -3);
+    assert(fp47map_replace(map, nasam(1), 1, 2) == -3);
+    assert(fp47map_shrink(map) == -3);
+    assert(fp47map_freeze(map) == rc);
+    recheck(map, imax);
+    fp47map_free(map);
+}
+
+// With incremental resizing, the entries must be found while the buckets
+// are being split, and after the split is complete.
+static void test_incremental(int simd)
+{
+    for (int k = 0; k < 2; k++) {
+	size_t inuse = 0;
+	struct fp47map_alloc alloc = { xalloc, xgrow, xfree, &inuse };
+	struct fp47map *map = k ? fp47map_new_alloc(10, &alloc) : fp47map_new(10);
+	assert(map);
+	fp47m_init(map, simd);
+	fp47map_incremental(map, 1);
+	unsigned nmig = 0;
+	unsigned imax = UINT16_MAX;
+	for (unsigned i = 1; i <= imax; i += 2) {
+	    uint32_t mig = map->mig;
+	    int rc = fp47map_insert(map, nasam(i), i);
+	    assert(rc > 0);
+	    if (!map->mig == !mig)
+		continue;
+	    assert(rc == 2);
+	    recheck(map, i);
+	    if (!map->mig)
+		continue;
+	    // A partially split map can be saved and loaded.
+	    if (++nmig == 2 && !k) {
+		char path[] = "/tmp/test-fp47map.XXXXXX";
+		int fd = mkstemp(path);
+		assert(fd >= 0);
+		assert(fp47map_save(map, fd) == 0);
+		close(fd);
+		struct fp47map *map2 = fp47map_open_mmap(path);
+		assert(map2);
+		unlink(path);
+		assert(map2->mig == map->mig);
+		recheck(map2, i);
+		for (unsigned j = i + 2; j <= imax; j += 2)
+		    assert(fp47map_insert(map2, nasam(j), j) > 0);
+		recheck(map2, imax);
+		fp47map_free(map2);
+	    }
+	    // Replace and delete some entries in the middle of the split.
+	    for (unsigned j = 1; j < i; j += 2 * 7) {
+		assert(fp47map_replace(map, nasam(j), j, j + 1) == 1);
+		assert(fp47map_replace(map, nasam(j), j + 1, j) == 1);
+		assert(fp47map_delete(map, nasam(j), j) == 1);
+		assert(fp47map_insert(map, nasam(j), j) > 0);
+	    }
+	    recheck(map, i);
+	    // Turning it off completes the split.
+	    if (nmig == 2 && k) {
+		fp47map_incremental(map, 0);
+		assert(map->mig == 0);
+		recheck(map, i);
+		fp47map_incremental(map, 1);
+	    }
+	}
+	assert(nmig >= 2);
+	recheck(map, imax);
+	fp47map_free(map);
+	assert(inuse == 0);
+    }
+}
+
+// The tasks of a thread pool, run in reverse order.
+static void runpool(void *ctx, unsigned n, void (*task)(void *arg, unsigned j), void *arg)
+{
+    while (n)
+	task(arg, --n);
+    ++*(unsigned *) ctx;
+}
+
+// Parallel resizes must produce exactly the same buckets.
+static void test_threads(int simd)
+{
+    unsigned npool = 0, nresize = 0;
+    struct fp47map_pool pool = { runpool, &npool };
+    for (int k = 0; k < 3; k++) {
+	// Without the grow hook, the buckets are not converted in place.
+	size_t inuse = 0;
+	struct fp47map_alloc alloc = { xalloc, NULL, xfree, &inuse };
+	struct fp47map *map1 = fp47map_new(16);
+	struct fp47map *map2 = k < 2 ? fp47map_new(16) : fp47map_new_alloc(16, &alloc);
+	assert(map1 && map2);
+	fp47m_init(map1, simd);
+	fp47m_init(map2, simd);
+	fp47map_threads(map2, 4, k == 1 ? &pool : NULL);
+	unsigned imax = (1 << 19) - 1;
+	for (unsigned i = 1; i <= imax; i += 2) {
+	    int rc = fp47map_insert(map1, nasam(i), i);
+	    assert(rc > 0);
+	    assert(fp47map_insert(map2, nasam(i), i) == rc);
+	    nresize += k == 1 && rc == 2;
+	}
+	assert(map2->bsize == 4 && map2->logsize1 > map2->logsize0);
+	assert(map2->mask1 == map1->mask1 && map2->nstash == map1->nstash);
+	assert(memcmp(map2->bb, map1->bb, (map1->mask1 + (size_t) 1) * 32) == 0);
+	recheck(map2, imax);
+	fp47map_free(map1);
+	fp47map_free(map2);
+	assert(inuse == 0);
+    }
+    // The pool does every resize of the map (how many depends on the fill
+    // factor, e.g. with narrow windows).
+    assert(npool > 0 && npool == nresize);
+}
+
+// Build the map from an array, in parallel and serially.
+static void test_build(void)
+{
+    unsigned imax = (1 << 19) - 1;
+    size_t n = imax / 2 + 1;
+    uint64_t *fps = malloc(n * sizeof *fps);
+    uint32_t *pos = malloc(n * sizeof *pos);
+    assert(fps && pos);
+    for (unsigned i = 1; i <= imax; i += 2)
+	fps[i/2] = nasam(i), pos[i/2] = i;
+    for (int nthreads = 1; nthreads <= 4; nthreads *= 2) {
+	struct fp47map *map = fp47map_build(fps, pos, n, nthreads);
+	assert(map);
+	recheck(map, imax);
+	assert(fp47map_insert(map, nasam(imax + 2), imax + 2) > 0);
+	recheck(map, imax + 2);
+	fp47map_free(map);
+    }
+    struct fp47map *map = fp47map_build(fps, pos, 999, 4);
+    assert(map);
+    recheck(map, 1997);
+    fp47map_free(map);
+    free(fps);
+    free(pos);
+}
+
+// Each entry must be visited once, with the tag of its key.
+struct seen {
+    unsigned char *v;
+    size_t n, stop;
+};
+
+static int seen1(void *arg, uint32_t i, uint32_t tag, uint32_t pos)
+{
+    struct seen *s = arg;
+    (void) i;
+    assert((pos & 1) && !s->v[pos/2]);
+    assert(tag == mod32(nasam(pos)));
+    s->v[pos/2] = 1;
+    return ++s->n == s->stop;
+}
+
+static void test_foreach(int simd)
+{
+    struct fp47map *map = newmap(simd, 10, NULL, false);
+    // Also in the middle of the incremental splits.
+    fp47map_incremental(map, 1);
+    unsigned imax = UINT16_MAX;
+    unsigned char *v = malloc(imax / 2 + 1);
+    assert(v);
+    for (unsigned i = 1; i <= imax; i += 2) {
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+	if (i % 2048 != 1 && i != imax)
+	    continue;
+	size_t cnt = map->cnt + map->nstash;
+	struct seen s = { v, 0, 0 };
+	memset(v, 0, imax / 2 + 1);
+	assert(fp47map_foreach(map, seen1, &s) == 0);
+	assert(s.n == cnt);
+	// In chunks, for parallel scans.
+	memset(v, 0, imax / 2 + 1);
+	s.n = 0;
+	size_t nb = fp47map_nbuckets(map);
+	for (size_t lo = 0; lo < nb; lo += 99)
+	    assert(fp47map_foreach_range(map, lo, lo + 99, seen1, &s) == 0);
+	assert(s.n == cnt);
+	for (unsigned j = 1; j <= i; j += 2)
+	    assert(v[j/2]);
+	// The iteration can be stopped.
+	memset(v, 0, imax / 2 + 1);
+	s.n = 0, s.stop = cnt / 2 + 1;
+	assert(fp47map_foreach(map, seen1, &s) == 1);
+	assert(s.n == s.stop);
+    }
+    free(v);
+    fp47map_free(map);
+}
+
+static void test_stats(int simd)
+{
+    struct fp47map *map = newmap(simd, 4, NULL, false);
+    unsigned n = 1 << 14;
+    for (unsigned i = 1; i <= n; i++)
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+    uint32_t mpos[FP47MAP_MAXFIND];
+    unsigned hits = 0, multi = 0;
+    for (unsigned i = 1; i <= 2 * n; i++) {
+	unsigned nf = fp47map_find(map, nasam(i), mpos);
+	assert(nf || i > n);
+	hits += nf > 0, multi += nf > 1;
+    }
+    struct fp47map_stats st;
+    int rc = fp47map_stats(map, &st);
+#ifdef FP47M_STATS
+    assert(rc == 0);
+    assert(st.inserts == n);
+    assert(st.finds == 2 * n);
+    assert(st.hits == hits && st.multi == multi);
+    assert(st.resizes == (unsigned) (map->bsize == 4) + map->logsize1 - map->logsize0);
+    assert(st.resize_ns >= st.restash_ns);
+    uint64_t nk = st.kickfail;
+    for (int k = 0; k < 8; k++)
+	nk += st.kickhist[k];
+    assert(nk > 0 && nk <= st.kicks);
+    assert(st.stashed || !st.sthits);
+#else
+    assert(rc == -1 && st.finds == 0 && st.resizes == 0);
+    (void) hits, (void) multi;
+#endif
+    fp47map_free(map);
+    // Near the fill limit, the paths are searched breadth-first; they still
+    // have to fit in the maxkick budget: with maxkick=1, an insert takes
+    // either 1 or 2 kicks, which go to kickhist[0] and kickhist[4].
+    struct fp47map_policy tight = { 100, 100, 1 };
+    map = newmap(simd, 4, NULL, false);
+    assert(fp47map_policy(map, &tight) == 0);
+    for (unsigned i = 1; i <= n; i++)
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+#ifdef FP47M_STATS
+    assert(fp47map_stats(map, &st) == 0);
+    nk = st.kickfail;
+    for (int k = 0; k < 8; k++)
+	nk += st.kickhist[k];
+    assert(nk > 0 && nk == st.kickfail + st.kickhist[0] + st.kickhist[4]);
+#endif
+    fp47map_free(map);
+}
+
+// The buckets hold all the entries, and the parallel scan agrees.
+static void check_analyze(struct fp47map *map)
+{
+    struct fp47map_analysis an, pan;
+    fp47map_analyze(map, &an);
+    assert(an.nbuckets == fp47map_nbuckets(map) && an.cnt == map->cnt);
+    size_t nb = 0, cnt = 0, gcnt = 0;
+    for (unsigned k = 0; k <= an.bsize; k++)
+	nb += an.fill[k], cnt += k * an.fill[k];
+    for (unsigned k = 1; k < 9; k++)
+	gcnt += k * an.groups[k];
+    assert(nb == an.nbuckets && cnt == an.cnt && gcnt == an.cnt);
+    assert(an.alt <= an.cnt && an.groups[1] > an.cnt / 2);
+    assert(an.load > 0 && an.load <= 1);
+    for (unsigned j = 0; j < an.nstash; j++)
+	assert(an.stash[j].tag == mod32(nasam(an.stash[j].pos)));
+    fp47map_threads(map, 4, NULL);
+    fp47map_analyze(map, &pan);
+    fp47map_threads(map, 1, NULL);
+    assert(memcmp(&an, &pan, sizeof an) == 0);
+}
+
+static void test_analyze(int simd)
+{
+    struct fp47map *map = newmap(simd, 4, NULL, false);
+    fp47map_incremental(map, 1);
+    for (unsigned i = 1; i < (1 << 18); i += 2) {
+	assert(fp47map_insert(map, nasam(i), i) > 0);
+	if ((i & (i + 1)) == 0 || (map->mig && i % 4096 == 1))
+	    check_analyze(map);
+    }
+    check_analyze(map);
+    fp47map_free(map);
+}
+
+static void test_policy(int simd)
+{
+    struct fp47map_policy bad = { 101, 0, 0 };
+    struct fp47map_policy lazy = { 70, 80, 0 };
+    struct fp47map_policy small = { 60, 0, 0 };
+    struct fp47map_policy dense = { 97, 0, 255 };
+    struct fp47map_policy eager = { 0, 40, 0 };
+    struct fp47map_policy *pp[] = { NULL, &small, &dense, &eager };
+    struct fp47map_analysis an[4];
+    int bsize[4];
+    // With the default policy, the 4-entry buckets are resized at the fill
+    // limit (90.6%), unless the stash overflows first, which happens with
+    // narrow windows: at about 33% with k=2, 51% with k=3, 64% with k=4,
+    // and 87% with k=8.
+#if !defined(FP47M_WINDOW) || FP47M_WINDOW >= 12
+    const double resizeload = 0.9;
+#elif FP47M_WINDOW >= 8
+    const double resizeload = 0.85;
+#elif FP47M_WINDOW >= 4
+    const double resizeload = 0.6;
+#elif FP47M_WINDOW == 3
+    const double resizeload = 0.45;
+#else
+    const double resizeload = 0.3;
+#endif
+    for (int k = 0; k < 4; k++) {
+	struct fp47map *map = newmap(simd, 10, NULL, false);
+	assert(fp47map_policy(map, &bad) == -1);
+	assert(fp47map_policy(map, &lazy) == -1);
+	if (pp[k])
+	    assert(fp47map_policy(map, pp[k]) == 0);
+	assert(map->maxkick == (k == 2 ? 255 : 33));
+	for (unsigned i = 1; i <= 1200; i++)
+	    assert(fp47map_insert(map, nasam(i), i) > 0);
+	bsize[k] = map->bsize;
+	for (unsigned i = 1201; i <= 245000; i++) {
+	    size_t cnt = map->cnt + map->nstash;
+	    size_t slots = (map->mask1 + (size_t) 1) * map->bsize;
+	    bool four = map->bsize == 4;
+	    int rc = fp47map_insert(map, nasam(i), i);
+	    assert(rc > 0);
+	    if (k == 0 && four && rc == 2)
+		assert(cnt > slots * resizeload);
+	}
+	for (unsigned i = 1; i <= 245000; i++) {
+	    uint32_t mpos[FP47MAP_MAXFIND];
+	    unsigned n = fp47map_find(map, nasam(i), mpos);
+	    assert(n >= 1 && mpos[0] == i);
+	}
+	fp47map_analyze(map, &an[k]);
+#ifndef FP47M_WINDOW
+	// The map shrinks at half of the fill limit: 35% is too full with
+	// maxload=60, but is low enough with the defaults.
+	if (k == 1 && map->bsize == 4) {
+	    size_t half = 2 * ((size_t) map->mask1 + 1);
+	    for (unsigned i = 245000; map->cnt + map->nstash > half * 35 / 100; i--)
+		assert(fp47map_delete(map, nasam(i), i) == 1);
+	    assert(fp47map_shrink(map) == 0);
+	    assert(fp47map_policy(map, &(struct fp47map_policy) { 0, 0, 0 }) == 0);
+	    assert(fp47map_shrink(map) == 1);
+	}
+#endif
+	fp47map_free(map);
+    }
+    // With narrow windows, the stash overflows before the map is full.
+#if !defined(FP47M_BRIM) && !defined(FP47M_WINDOW)
+    // The 2-entry buckets are 58% full, which is above 40% but below 78%.
+    assert(bsize[0] == 2 && bsize[3] == 4);
+    assert(an[1].load <= 0.6 && an[1].nbuckets > an[2].nbuckets);
+    assert(an[2].load > 0.9 && an[2].nbuckets < an[0].nbuckets);
+#elif !defined(FP47M_BRIM)
+    // The policy still caps the load, and the dense map is never bigger.
+    assert(an[1].load <= 0.6 && an[2].nbuckets <= an[0].nbuckets);
+    (void) bsize;
+#else
+    (void) bsize, (void) an;
+#endif
+}
+
+// Several writers and readers: the keys must be found as soon as
+// they are inserted, while the entries are kicked and the map grows.
+#define MTKEYS (1 << 20)
+#define MTW 3
+static struct fp47map_mt *mt;
+static unsigned mtcnt[MTW];
+
+// Writer w inserts the keys w+1, w+1+MTW, etc.
+static void *writer(void *arg)
+{
+    unsigned w = (uintptr_t) arg;
+    for (unsigned k = 0; k < MTKEYS / MTW; k++) {
+	unsigned i = k * MTW + w + 1;
+	assert(fp47map_mt_insert(mt, nasam(i), i) > 0);
+	__atomic_store_n(&mtcnt[w], k + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    uint64_t x = (uintptr_t) arg;
+    unsigned n, w;
+    do {
+	x = nasam(x);
+	w = x % MTW;
+	n = __atomic_load_n(&mtcnt[w], __ATOMIC_ACQUIRE);
+	if (n == 0)
+	    continue;
+	unsigned i = (x >> 32) % n * MTW + w + 1;
+	uint32_t mpos[FP47MAP_MAXFIND];
+	unsigned k = fp47map_mt_find(mt, nasam(i), mpos);
+	bool found = false;
+	for (unsigned j = 0; j < k; j++)
+	    found |= mpos[j] == i;
+	assert(found);
+    } while (n < MTKEYS / MTW);
+    return NULL;
+}
+
+static void test_mt(void)
+{
+    mt = fp47map_mt_new(10);
+    assert(mt);
+    pthread_t t[MTW+2];
+    for (uintptr_t j = 0; j < MTW; j++)
+	assert(pthread_create(&t[j], NULL, writer, (void *) j) == 0);
+    for (uintptr_t j = MTW; j < MTW + 2; j++)
+	assert(pthread_create(&t[j], NULL, reader, (void *) j) == 0);
+    for (int j = 0; j < MTW + 2; j++)
+	assert(pthread_join(t[j], NULL) == 0);
+    uint32_t mpos[FP47MAP_MAXFIND];
+    for (unsigned i = 1; i <= MTKEYS / MTW * MTW; i++)
+	assert(fp47map_mt_find(mt, nasam(i), mpos) > 0);
+    fp47map_mt_free(mt);
+}
+
+static void test_sharded(void)
+{
+    struct fp47map_sharded *s = fp47map_sharded_new(4, 10);
+    assert(s);
+    static uint64_t fps[1000];
+    static uint32_t pos[1000], mpos[1000][FP47MAP_MAXFIND];
+    static unsigned nfound[1000];
+    unsigned imax = 0;
+    while (imax < UINT16_MAX) {
+	for (unsigned j = 0; j < 1000; j++)
+	    fps[j] = nasam(imax + j + 1), pos[j] = imax + j + 1;
+	assert(fp47map_sharded_insert_batch(s, fps, pos, 1000) > 0);
+	imax += 1000;
+    }
+    for (unsigned i = imax + 1; i <= imax + 1000; i++)
+	assert(fp47map_sharded_insert(s, nasam(i), i) > 0);
+    imax += 1000;
+    for (unsigned i0 = 0; i0 < imax; i0 += 1000) {
+	for (unsigned j = 0; j < 1000; j++)
+	    fps[j] = nasam(i0 + j + 1);
+	fp47map_sharded_find_batch(s, fps, 1000, mpos, nfound);
+	for (unsigned j = 0; j < 1000; j++) {
+	    assert(nfound[j] == fp47map_sharded_find(s, fps[j], mpos[j]));
+	    bool found = false;
+	    for (unsigned k = 0; k < nfound[j]; k++)
+		found |= mpos[j][k] == i0 + j + 1;
+	    assert(found);
+	}
+    }
+    for (unsigned i = 1; i <= imax; i += 2)
+	assert(fp47map_sharded_delete(s, nasam(i), i) == 1);
+    for (unsigned i = 1; i <= imax; i++) {
+	unsigned n = fp47map_sharded_find(s, nasam(i), mpos[0]);
+	bool found = false;
+	for (unsigned k = 0; k < n; k++)
+	    found |= mpos[0][k] == i;
+	assert(found == !(i & 1));
+    }
+    // The lookups and inserts are counted in the shards.
+    struct fp47map_stats st;
+    int rc = fp47map_sharded_stats(s, &st);
+#ifdef FP47M_STATS
+    assert(rc == 0 && st.inserts == imax && st.finds == 3 * (uint64_t) imax);
+    assert(st.hits >= 2 * (uint64_t) imax + imax / 2);
+#else
+    assert(rc == -1 && st.inserts == 0);
+#endif
+    fp47map_sharded_free(s);
+}
+
 int main()
 {
-   uint64_t h0 = test(true);
-   uint64_t h1 = test(false);
-   assert(h0 == h1);
+   uint64_t h0 = test(0, false);
+   // Batch inserts must produce exactly the same buckets.
+   assert(test(0, true) == h0);
+   test_delete(0);
+   test_stash(0, false);
+   test_stash(0, true);
+   test_reserve(0);
+   test_huge();
+   test_alloc(0);
+   test_save(0);
+   test_freeze(0);
+   test_incremental(0);
+   test_threads(0);
+   test_build();
+   test_foreach(0);
+   test_stats(0);
+   test_analyze(0);
+   test_policy(0);
+   test_mt();
+   test_sharded();
+#if defined(__i386__) || defined(__x86_64__)
+   for (int simd = 1; simd <= 3; simd++) {
+       if (simd == 1 && !__builtin_cpu_supports("sse4.1"))
+	   break;
+       if (simd == 2 && !__builtin_cpu_supports("avx2"))
+	   break;
+       if (simd == 3 && !(__builtin_cpu_supports("avx512f") &&
+			  __builtin_cpu_supports("avx512vl")))
+	   break;
+       assert(test(simd, false) == h0);
+       assert(test(simd, true) == h0);
+       test_delete(simd);
+       test_stash(simd, false);
+       test_stash(simd, true);
+       test_reserve(simd);
+       test_alloc(simd);
+       test_save(simd);
+       test_freeze(simd);
+       test_incremental(simd);
+       test_threads(simd);
+       test_foreach(simd);
+       test_stats(simd);
+       test_analyze(simd);
+       test_policy(simd);
+   }
+#endif
    printf("%016" PRIx64 "\n", h0);
    return 0;
 }